@@ -0,0 +1,351 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <new>
+#include <random>
+#include <benchmark/benchmark.h>
+#include <glm/matrix.hpp>
+#include <model_scanner/AprilTagDetector.h>
+#include <model_scanner/Camera.h>
+#include <model_scanner/CpuCarver.h>
+#include <model_scanner/Octree.h>
+
+// Microbenchmarks of the scanner's hot paths. Every benchmark reports the
+// bytes and allocations per iteration next to its throughput, counted by the
+// global operator new below. The array and nothrow forms end up in these.
+
+namespace {
+
+std::atomic<size_t> allocatedBytes{ 0 };
+std::atomic<size_t> allocations{ 0 };
+
+void countAllocation(size_t size) {
+  allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+  allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+  countAllocation(size);
+  if (void* p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+// Used for types aligned past what malloc guarantees, such as cache line
+// aligned queue indices
+void* operator new(size_t size, std::align_val_t align) {
+  countAllocation(size);
+  size_t alignment = static_cast<size_t>(align);
+  // aligned_alloc needs the size to be a multiple of the alignment
+  size_t rounded = (std::max(size, size_t(1)) + alignment - 1) / alignment *
+                   alignment;
+  if (void* p = std::aligned_alloc(alignment, rounded))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+using namespace model_scanner;
+
+namespace {
+
+constexpr int FRAME_WIDTH = 320;
+constexpr int FRAME_HEIGHT = 240;
+constexpr float FOCAL_LENGTH = 300.0;
+constexpr float CAMERA_DISTANCE = 5.0;
+constexpr size_t CARVE_VIEWS = 24;
+constexpr float THRESHOLD = 0.9;
+constexpr size_t VIDEO_FRAMES = 16;
+
+class AllocationCounter {
+public:
+  AllocationCounter()
+    : _bytes(allocatedBytes.load()), _count(allocations.load()) {}
+
+  void report(benchmark::State& state) const {
+    state.counters["bytes_alloc"] = benchmark::Counter(
+        allocatedBytes.load() - _bytes, benchmark::Counter::kAvgIterations);
+    state.counters["allocs"] = benchmark::Counter(
+        allocations.load() - _count, benchmark::Counter::kAvgIterations);
+  }
+
+private:
+  size_t _bytes;
+  size_t _count;
+};
+
+struct Sphere {
+  glm::vec3 center;
+  float radius;
+};
+
+// One large sphere, or many small ones scattered around the volume, which
+// leaves a fragmented model with many more faces
+std::vector<Sphere> pattern(int idx) {
+  if (idx == 0)
+    return { { glm::vec3(0.0), 0.6 } };
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> pos(-0.8, 0.8);
+  std::vector<Sphere> spheres;
+  for (int i = 0; i < 40; ++i)
+    spheres.push_back({ glm::vec3(pos(rng), pos(rng), pos(rng)), 0.08 });
+  return spheres;
+}
+
+glm::mat4 projection() {
+  float znear = 0.01;
+  float zfar = 10.0;
+  glm::mat4 proj(0.0);
+  proj[0][0] = 2.0 * FOCAL_LENGTH / FRAME_WIDTH;
+  proj[1][1] = 2.0 * FOCAL_LENGTH / FRAME_HEIGHT;
+  proj[2][2] = -(zfar + znear) / (zfar - znear);
+  proj[2][3] = -1.0;
+  proj[3][2] = -2.0 * zfar * znear / (zfar - znear);
+  return proj;
+}
+
+glm::mat4 viewFrom(size_t idx) {
+  float theta = idx * 0.7;
+  float phi = 0.3 + 0.12 * (idx % 20);
+  glm::vec3 eye = CAMERA_DISTANCE *
+                  glm::vec3(std::cos(theta) * std::sin(phi),
+                            std::sin(theta) * std::sin(phi), std::cos(phi));
+  glm::vec3 f = glm::normalize(-eye);
+  glm::vec3 up = std::abs(f.z) > 0.9 ? glm::vec3(0, 1, 0) : glm::vec3(0, 0, 1);
+  glm::vec3 s = glm::normalize(glm::cross(f, up));
+  glm::vec3 u = glm::cross(s, f);
+  glm::mat4 view(1.0);
+  for (int i = 0; i < 3; ++i) {
+    view[i][0] = s[i];
+    view[i][1] = u[i];
+    view[i][2] = -f[i];
+  }
+  view[3][0] = -glm::dot(s, eye);
+  view[3][1] = -glm::dot(u, eye);
+  view[3][2] = glm::dot(f, eye);
+  return view;
+}
+
+// The spheres are dark on a light background, as the carvers expect
+cv::Mat silhouette(const std::vector<Sphere>& spheres, const glm::mat4& proj,
+                   const glm::mat4& view) {
+  glm::mat4 invProj = glm::inverse(proj);
+  glm::mat4 invView = glm::inverse(view);
+  glm::vec3 origin(invView * glm::vec4(0.0, 0.0, 0.0, 1.0));
+  cv::Mat frame(FRAME_HEIGHT, FRAME_WIDTH, CV_8UC3);
+  for (int y = 0; y < FRAME_HEIGHT; ++y) {
+    for (int x = 0; x < FRAME_WIDTH; ++x) {
+      glm::vec4 screen((x + 0.5f) / FRAME_WIDTH * 2.0f - 1.0f,
+                       (y + 0.5f) / FRAME_HEIGHT * 2.0f - 1.0f, -1.0, 1.0);
+      glm::vec4 far = invView * invProj * screen;
+      glm::vec3 dir = glm::normalize(glm::vec3(far) / far.w - origin);
+      bool hit = false;
+      for (const Sphere& sphere : spheres) {
+        glm::vec3 toCenter = sphere.center - origin;
+        float along = glm::dot(toCenter, dir);
+        float dist2 = glm::dot(toCenter, toCenter) - along * along;
+        hit |= along > 0.0 && dist2 < sphere.radius * sphere.radius;
+      }
+      frame.at<cv::Vec3b>(y, x) = hit ? cv::Vec3b(0, 0, 0)
+                                      : cv::Vec3b(255, 255, 255);
+    }
+  }
+  return frame;
+}
+
+const std::vector<cv::Mat>& silhouettes(int patternIdx) {
+  static std::map<int, std::vector<cv::Mat>> cache;
+  auto it = cache.find(patternIdx);
+  if (it != cache.end())
+    return it->second;
+  std::vector<Sphere> spheres = pattern(patternIdx);
+  std::vector<cv::Mat>& frames = cache[patternIdx];
+  for (size_t i = 0; i < CARVE_VIEWS; ++i)
+    frames.push_back(silhouette(spheres, projection(), viewFrom(i)));
+  return frames;
+}
+
+Octree emptyOctree(int depth, bool sparse = false) {
+  return Octree(glm::vec4(-1.0, -1.0, -1.0, 1.0), glm::vec4(1.0, 1.0, 1.0, 1.0),
+                depth, sparse);
+}
+
+Octree& carvedOctree(int patternIdx, int depth) {
+  static std::map<std::pair<int, int>, std::unique_ptr<Octree>> cache;
+  std::unique_ptr<Octree>& octree = cache[{ patternIdx, depth }];
+  if (octree)
+    return *octree;
+  octree = std::make_unique<Octree>(emptyOctree(depth));
+  CpuCarver carver(*octree);
+  const std::vector<cv::Mat>& frames = silhouettes(patternIdx);
+  for (size_t i = 0; i < frames.size(); ++i)
+    carver.carve(frames[i], projection(), viewFrom(i));
+  carver.flush();
+  return *octree;
+}
+
+struct VideoFrames {
+  std::unique_ptr<Camera> camera;
+  std::vector<cv::Mat> raw;
+};
+
+const VideoFrames& videoFrames() {
+  static VideoFrames video;
+  if (video.camera)
+    return video;
+  std::string dir = MODEL_SCANNER_EXAMPLES_DIR;
+  video.camera = std::make_unique<Camera>(dir + "/zip_tie.mp4",
+                                          dir + "/camera_info.yml");
+  cv::Mat raw;
+  while (video.raw.size() < VIDEO_FRAMES && video.camera->read(raw))
+    video.raw.push_back(raw.clone());
+  return video;
+}
+
+// The count follows the 80 byte header of a binary STL file
+uint32_t stlTriangles(const std::string& filename) {
+  uint32_t numTris = 0;
+  std::ifstream file(filename, std::ios::binary);
+  file.seekg(80);
+  file.read((char*) &numTris, sizeof(numTris));
+  return numTris;
+}
+
+void BM_OctreeConstruct(benchmark::State& state) {
+  int depth = state.range(0);
+  bool sparse = state.range(1);
+  AllocationCounter counter;
+  for (auto _ : state) {
+    Octree octree = emptyOctree(depth, sparse);
+    benchmark::DoNotOptimize(octree);
+  }
+  counter.report(state);
+  // Leaf cells of the volume either way, so sparse and dense rows compare
+  state.SetItemsProcessed(state.iterations() * (int64_t(1) << 3 * depth));
+}
+// Dense trees past depth 8 need more than a gigabyte
+BENCHMARK(BM_OctreeConstruct)
+    ->ArgNames({ "depth", "sparse" })
+    ->ArgsProduct({ benchmark::CreateDenseRange(4, 8, 1), { 0 } })
+    ->ArgsProduct({ benchmark::CreateDenseRange(4, 9, 1), { 1 } })
+    ->Unit(benchmark::kMicrosecond);
+
+void BM_OctreeWrite(benchmark::State& state) {
+  Octree& octree = carvedOctree(state.range(0), state.range(1));
+  bool mergeFaces = state.range(2);
+  std::string filename =
+      (std::filesystem::temp_directory_path() / "model-scanner-bench.stl")
+          .string();
+  AllocationCounter counter;
+  for (auto _ : state)
+    octree.write(filename, THRESHOLD, mergeFaces);
+  counter.report(state);
+  state.SetItemsProcessed(state.iterations() * stlTriangles(filename));
+  state.SetBytesProcessed(state.iterations() *
+                          std::filesystem::file_size(filename));
+  std::filesystem::remove(filename);
+}
+BENCHMARK(BM_OctreeWrite)
+    ->ArgNames({ "pattern", "depth", "merge" })
+    ->ArgsProduct({ { 0, 1 }, { 5, 6, 7 }, { 0, 1 } })
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+void BM_CpuCarve(benchmark::State& state) {
+  const std::vector<cv::Mat>& frames = silhouettes(state.range(0));
+  Octree octree = emptyOctree(state.range(1));
+  CpuCarver carver(octree);
+  size_t view = 0;
+  AllocationCounter counter;
+  for (auto _ : state) {
+    carver.carve(frames[view], projection(), viewFrom(view));
+    view = (view + 1) % frames.size();
+  }
+  carver.flush();
+  counter.report(state);
+  state.SetItemsProcessed(state.iterations() * FRAME_WIDTH * FRAME_HEIGHT);
+}
+BENCHMARK(BM_CpuCarve)
+    ->ArgNames({ "pattern", "depth" })
+    ->ArgsProduct({ { 0, 1 }, { 4, 5, 6 } })
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+void BM_CameraUndistort(benchmark::State& state) {
+  const VideoFrames& video = videoFrames();
+  if (video.raw.empty()) {
+    state.SkipWithError("No frames in the example video");
+    return;
+  }
+  cv::Mat rgb;
+  cv::Mat grey;
+  size_t frame = 0;
+  AllocationCounter counter;
+  for (auto _ : state) {
+    if (state.range(0))
+      video.camera->undistortGrey(video.raw[frame], grey);
+    else
+      video.camera->undistort(video.raw[frame], rgb, grey);
+    frame = (frame + 1) % video.raw.size();
+  }
+  counter.report(state);
+  state.SetItemsProcessed(state.iterations() * video.raw[0].total());
+  state.SetBytesProcessed(state.iterations() * video.raw[0].total() *
+                          video.raw[0].elemSize());
+}
+BENCHMARK(BM_CameraUndistort)
+    ->ArgName("greyOnly")
+    ->Arg(0)
+    ->Arg(1)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+void BM_AprilTagSetFrame(benchmark::State& state) {
+  const VideoFrames& video = videoFrames();
+  if (video.raw.empty()) {
+    state.SkipWithError("No frames in the example video");
+    return;
+  }
+  AprilTagDetector detector(*video.camera);
+  detector.addTagParams({ .id = 0, .tagSize = 0.08333333333 });
+  detector.setTracking(state.range(0));
+  size_t frame = 0;
+  AllocationCounter counter;
+  for (auto _ : state) {
+    detector.setFrame(video.raw[frame]);
+    frame = (frame + 1) % video.raw.size();
+  }
+  counter.report(state);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_AprilTagSetFrame)
+    ->ArgName("tracking")
+    ->Arg(0)
+    ->Arg(1)
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+BENCHMARK_MAIN();
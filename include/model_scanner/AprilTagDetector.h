@@ -24,7 +24,16 @@ public:
 
   void addTagParams(TagParams params);
   void setFrame(const cv::Mat& frame);
+  void setGreyFrame(const cv::Mat& grey);
+  // Detects in a frame as it was captured, e.g. the decoder's Y plane, and
+  // only undistorts the corners of the tags found
+  void setRawGreyFrame(const cv::Mat& grey);
   glm::mat4 getPose(int id);
+  // How clearly the tag was told apart from noise, 0 when it was not found
+  float getMargin(int id);
+  // Search around where the tags were in the last frame first, falling back
+  // to the whole frame when none of them is found there
+  void setTracking(bool tracking);
 
 private:
   apriltag_detector_t* _td;
@@ -32,7 +41,20 @@ private:
   std::map<int, double> _tagSizes;
 
   std::map<int, glm::mat4> _lastFrameTagPos;
+  std::map<int, float> _lastFrameMargin;
   apriltag_detection_info_t _info;
+  cv::Mat _k;
+  cv::Mat _d;
+  bool _tracking;
+
+  void detectTags(const cv::Mat& grey, bool raw);
+  zarray_t* detect(const cv::Mat& grey, cv::Rect roi);
+  void undistortCorners(apriltag_detection_t* det) const;
+  bool hasKnownTag(zarray_t* detections) const;
+  bool predictRegion(cv::Rect frame, cv::Rect& roi) const;
+
+  static constexpr float ROI_PADDING = 0.5;
+  static constexpr float ROI_MARGIN = 16.0;
 };
 
 }  // namespace model_scanner
@@ -0,0 +1,122 @@
+#ifndef MODEL_SCANNER_BOUNDED_QUEUE_H
+#define MODEL_SCANNER_BOUNDED_QUEUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace model_scanner {
+
+// Lock-free bounded MPMC queue. Every cell carries a sequence number that
+// tells producers and consumers whose turn it is, so neither side ever waits
+// on the other to finish a push or pop. Callers that find the queue full or
+// empty block on the push and pop counters instead of spinning.
+template <typename T>
+class BoundedQueue {
+public:
+  // capacity is rounded up to a power of two
+  BoundedQueue(size_t capacity)
+    : _head(0), _tail(0), _pushes(0), _pops(0) {
+    size_t size = 1;
+    while (size < capacity)
+      size *= 2;
+    _cells = std::make_unique<Cell[]>(size);
+    _mask = size - 1;
+    for (size_t i = 0; i < size; ++i)
+      _cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  bool tryPush(const T& value) {
+    size_t pos = _tail.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = _cells[pos & _mask];
+      intptr_t diff =
+          cell.sequence.load(std::memory_order_acquire) - pos;
+      if (diff == 0) {
+        if (_tail.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          cell.value = value;
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          signal(_pushes);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = _tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool tryPop(T& value) {
+    size_t pos = _head.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = _cells[pos & _mask];
+      intptr_t diff =
+          cell.sequence.load(std::memory_order_acquire) - (pos + 1);
+      if (diff == 0) {
+        if (_head.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          value = cell.value;
+          cell.sequence.store(pos + _mask + 1, std::memory_order_release);
+          signal(_pops);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = _head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  size_t capacity() const {
+    return _mask + 1;
+  }
+
+  // Read the counter before trying, then wait on it if the try failed, so a
+  // push or pop in between is never missed
+  uint32_t pushes() const {
+    return _pushes.load(std::memory_order_acquire);
+  }
+
+  uint32_t pops() const {
+    return _pops.load(std::memory_order_acquire);
+  }
+
+  void waitForPush(uint32_t pushes) const {
+    _pushes.wait(pushes, std::memory_order_acquire);
+  }
+
+  void waitForPop(uint32_t pops) const {
+    _pops.wait(pops, std::memory_order_acquire);
+  }
+
+  // Wakes up every waiter, e.g. to have it look at a stop flag
+  void wake() {
+    signal(_pushes);
+    signal(_pops);
+  }
+
+private:
+  static void signal(std::atomic<uint32_t>& counter) {
+    counter.fetch_add(1, std::memory_order_release);
+    counter.notify_all();
+  }
+
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  std::unique_ptr<Cell[]> _cells;
+  size_t _mask;
+  alignas(64) std::atomic<size_t> _head;
+  alignas(64) std::atomic<size_t> _tail;
+  alignas(64) std::atomic<uint32_t> _pushes;
+  alignas(64) std::atomic<uint32_t> _pops;
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_BOUNDED_QUEUE_H
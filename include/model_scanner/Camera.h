@@ -1,6 +1,7 @@
 #ifndef MODEL_SCANNER_CAMERA_H
 #define MODEL_SCANNER_CAMERA_H
 
+#include <vector>
 #include <opencv2/opencv.hpp>
 
 namespace model_scanner {
@@ -15,15 +16,61 @@ public:
   Camera(const std::string& deviceName, const std::string& calibrationFile);
   ~Camera();
 
-  cv::Mat getFrame();
+  bool read(cv::Mat& rawImage);
+  bool ended() const;
+  const std::string& deviceName() const;
+  // Has read() return the frames as the decoder delivers them, for devices
+  // that deliver NV12, NV21, I420, YV12, YUYV or grey frames. Returns false,
+  // and keeps converting them to BGR, for any other format. read() rejects
+  // frames whose row stride and plane height cannot be worked out.
+  bool captureLuma();
+  bool capturesLuma() const;
+  // The Y plane of a frame read that way, without a copy unless it is YUYV.
+  // It is not undistorted.
+  cv::Mat luma(const cv::Mat& rawImage) const;
+  void toBgr(const cv::Mat& rawImage, cv::Mat& bgr) const;
+
+  // Undistorts a raw BGR frame in a single pass into the flipped RGB image
+  // that gets uploaded as the texture and the grey image for tag detection
+  void undistort(const cv::Mat& rawImage, cv::Mat& rgb, cv::Mat& grey) const;
+  void undistortGrey(const cv::Mat& rawImage, cv::Mat& grey) const;
+  void undistortRgb(const cv::Mat& rawImage, cv::Mat& rgb) const;
+  // Source pixel of every undistorted pixel, as from
+  // cv::initUndistortRectifyMap
+  const cv::Mat& undistortMapX() const;
+  const cv::Mat& undistortMapY() const;
 
   int width;
   int height;
 private:
+  // Bytes per row of the Y plane, or of a YUYV frame, and its rows with the
+  // padding before the chroma planes
+  struct Layout {
+    size_t stride;
+    int lumaRows;
+  };
+
+  // Top left source pixel and bilinear weights in 1/128ths
+  struct RemapEntry {
+    int16_t x;
+    int16_t y;
+    uint16_t wx;
+    uint16_t wy;
+  };
+
   std::string _deviceName;
   std::string _calibrationFile;
   cv::VideoCapture _cap;
-  cv::Mat _blankFrame;
+  bool _ended;
+  cv::Mat _mapX;
+  cv::Mat _mapY;
+  std::vector<RemapEntry> _remap;
+  bool _luma;
+  int _lumaConversion;
+
+  void remap(const cv::Mat& rawImage, cv::Mat* rgb, cv::Mat* grey) const;
+  bool frameLayout(const cv::Mat& rawImage, Layout& layout) const;
+  cv::Mat lumaPlane(const cv::Mat& rawImage, const Layout& layout) const;
 };
 
 }  // namespace model_scanner
@@ -0,0 +1,42 @@
+#ifndef MODEL_SCANNER_CARVER_H
+#define MODEL_SCANNER_CARVER_H
+
+#include <vector>
+#include <glm/matrix.hpp>
+#include <opencv2/opencv.hpp>
+#include <model_scanner/Octree.h>
+
+namespace model_scanner {
+
+// Carves an Octree on the CPU. frame is the flipped RGB image that gets
+// uploaded as the texture, so row y is the same as gl_FragCoord.y in the
+// shader.
+class Carver {
+public:
+  struct View {
+    const cv::Mat* frame;
+    glm::mat4 proj;
+    glm::mat4 modelView;
+  };
+
+  virtual ~Carver() = default;
+
+  virtual void carve(const cv::Mat& frame, const glm::mat4& proj,
+                     const glm::mat4& modelView) = 0;
+  // Carves the frames that several cameras took at the same time
+  virtual void carve(const std::vector<View>& views) {
+    for (const View& view : views)
+      carve(*view.frame, view.proj, view.modelView);
+  }
+  // Brings the octree's counters up to date before they are read or the
+  // tree is restructured
+  virtual void flush() {}
+  // Samples a node needs before Octree::refine decides on it
+  virtual uint32_t refineMinSamples() const {
+    return Octree::REFINE_MIN_SAMPLES;
+  }
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_CARVER_H
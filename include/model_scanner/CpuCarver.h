@@ -0,0 +1,51 @@
+#ifndef MODEL_SCANNER_CPU_CARVER_H
+#define MODEL_SCANNER_CPU_CARVER_H
+
+#include <vector>
+#include <model_scanner/Carver.h>
+#include <model_scanner/Octree.h>
+#include <model_scanner/RayBox.h>
+#include <model_scanner/ThreadPool.h>
+
+namespace model_scanner {
+
+class CpuCarver : public Carver {
+public:
+  CpuCarver(Octree& octree, size_t numThreads = 0);
+
+  void carve(const cv::Mat& frame, const glm::mat4& proj,
+             const glm::mat4& modelView) override;
+  void carve(const std::vector<View>& views) override;
+
+private:
+  struct Counters {
+    std::vector<uint32_t> hits;
+    std::vector<uint32_t> total;
+  };
+
+  struct Ray {
+    glm::vec3 origin;
+    glm::vec3 dir;
+    glm::vec3 invDir;
+  };
+
+  Octree& _octree;
+  ThreadPool _pool;
+  std::vector<Counters> _counters;
+
+  void carveTile(const cv::Mat& frame, const glm::mat4& invProj,
+                 const glm::mat4& invModelView, cv::Rect tile,
+                 Counters& counters);
+  void castRay(const Ray& ray, bool isBackground, Counters& counters);
+  void reduce();
+
+  static Ray getRay(glm::vec2 screenCoord, const glm::mat4& invProj,
+                    const glm::mat4& invModelView);
+
+  static constexpr int TILE_SIZE = 32;
+  static constexpr size_t REDUCE_CHUNK = 1 << 16;
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_CPU_CARVER_H
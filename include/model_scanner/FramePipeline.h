@@ -0,0 +1,90 @@
+#ifndef MODEL_SCANNER_FRAME_PIPELINE_H
+#define MODEL_SCANNER_FRAME_PIPELINE_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <glm/matrix.hpp>
+#include <opencv2/opencv.hpp>
+#include <model_scanner/AprilTagDetector.h>
+#include <model_scanner/BoundedQueue.h>
+#include <model_scanner/Camera.h>
+
+namespace model_scanner {
+
+// Decodes, undistorts and detects tags on their own threads, ahead of the
+// thread that carves. Frames live in a fixed ring of buffers that are handed
+// from stage to stage and recycled once carved.
+class FramePipeline {
+public:
+  enum Policy {
+    AUTO,         // DROP_OLDEST for devices, BLOCK for files
+    BLOCK,        // every frame is carved, stages wait for each other
+    DROP_OLDEST,  // a full stage throws away its oldest frame
+  };
+
+  struct Frame {
+    size_t index;
+    cv::Mat raw;
+    // Flipped RGB image. Left empty when the raw frame is undistorted on the
+    // GPU.
+    cv::Mat rgb;
+    // Undistorted, or the raw Y plane when the camera captures luma
+    cv::Mat grey;
+    // The raw frame converted from YUV, when the camera captures luma
+    cv::Mat bgr;
+    // The image to upload as the texture, either rgb or raw
+    cv::Mat upload;
+    glm::mat4 pose;
+    float margin;
+  };
+
+  // With uploadStorage, the image to upload for frame i is written to
+  // uploadStorage + i * slotSize, for all ringSize() frames
+  FramePipeline(Camera& camera, AprilTagDetector& detector, Policy policy,
+                bool gpuUndistort = false, uint8_t* uploadStorage = nullptr,
+                size_t slotSize = 0, size_t queueSize = QUEUE_SIZE);
+  ~FramePipeline();
+
+  // Returns the next frame, or nullptr once the source has ended. The frame
+  // stays valid until the next call.
+  const Frame* next();
+
+  static size_t ringSize(size_t queueSize = QUEUE_SIZE);
+  static constexpr size_t QUEUE_SIZE = 2;
+
+private:
+  using Queue = BoundedQueue<Frame*>;
+
+  Camera& _camera;
+  AprilTagDetector& _detector;
+  Policy _policy;
+  bool _gpuUndistort;
+  bool _luma;
+  bool _copyUpload;
+
+  std::vector<Frame> _ring;
+  Queue _free;
+  Queue _decoded;
+  Queue _undistorted;
+  Queue _detected;
+  std::atomic<bool> _decodeDone;
+  std::atomic<bool> _undistortDone;
+  std::atomic<bool> _detectDone;
+  std::atomic<bool> _stop;
+  Frame* _current;
+  std::vector<std::thread> _threads;
+
+  void decodeLoop();
+  void undistortLoop();
+  void detectLoop();
+  bool pop(Queue& queue, const std::atomic<bool>& done, Frame*& frame);
+  void push(Queue& queue, Frame* frame);
+  void recycle(Frame* frame);
+
+  static bool isDevice(const std::string& deviceName);
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_FRAME_PIPELINE_H
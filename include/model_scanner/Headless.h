@@ -0,0 +1,31 @@
+#ifndef MODEL_SCANNER_HEADLESS_H
+#define MODEL_SCANNER_HEADLESS_H
+
+#include <GL/glew.h>
+#include <EGL/egl.h>
+#include <model_scanner/Scanner.h>
+
+namespace model_scanner {
+
+class Headless {
+public:
+  Headless(const Scanner::Options& options);
+  ~Headless();
+
+  int run();
+
+private:
+  EGLDisplay _display;
+  EGLContext _context;
+  bool _valid;
+  bool _useGL;
+  std::string _traceFile;
+
+  Scanner _scanner;
+
+  bool createContext();
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_HEADLESS_H
@@ -0,0 +1,50 @@
+#ifndef MODEL_SCANNER_KEYFRAME_SELECTOR_H
+#define MODEL_SCANNER_KEYFRAME_SELECTOR_H
+
+#include <vector>
+#include <glm/matrix.hpp>
+#include <opencv2/opencv.hpp>
+
+namespace model_scanner {
+
+// Decides which frames are worth carving. Every carved frame is kept as the
+// direction and distance it saw the tag from. A frame is only carved when no
+// kept one is within angle degrees and a distance ratio of 1 + distance of
+// it, or when it is sharper and its tag more clearly detected than the
+// nearest kept one by a factor of 1 + gain, which then takes its place.
+class KeyframeSelector {
+public:
+  // An angle of 0 carves every frame
+  KeyframeSelector(float angle = 0.0, float distance = 0.1, float gain = 0.25);
+
+  bool enabled() const;
+  // pose is the tag's model view matrix, margin its decision margin
+  bool select(const glm::mat4& pose, const cv::Mat& grey, float margin);
+  void clear();
+  // Viewpoints kept, and frames selected since the last clear
+  size_t size() const;
+  size_t selected() const;
+
+  // Variance of the Laplacian over a sparse grid of pixels
+  static float sharpness(const cv::Mat& grey);
+
+private:
+  struct Keyframe {
+    glm::vec3 direction;
+    float distance;
+    float quality;
+  };
+
+  std::vector<Keyframe> _keyframes;
+  float _cosAngle;
+  float _maxLogDistance;
+  float _gain;
+  bool _enabled;
+  size_t _selected;
+
+  static constexpr int SHARPNESS_STEP = 4;
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_KEYFRAME_SELECTOR_H
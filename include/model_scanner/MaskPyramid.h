@@ -0,0 +1,33 @@
+#ifndef MODEL_SCANNER_MASK_PYRAMID_H
+#define MODEL_SCANNER_MASK_PYRAMID_H
+
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace model_scanner {
+
+// Min/max mipmaps of the binary silhouette mask of a frame, set where a
+// pixel is dark. Each level halves the previous one, so any rectangle is
+// covered by at most 3x3 texels of the level matching its size.
+class MaskPyramid {
+public:
+  enum Coverage { OUTSIDE, INSIDE, MIXED };
+
+  void build(const cv::Mat& frame);
+
+  // rect is in pixels of the frame and clipped to it
+  Coverage coverage(cv::Rect rect) const;
+  // Number of pixels in rect that are set
+  uint32_t count(cv::Rect rect) const;
+
+  int cols() const;
+  int rows() const;
+
+private:
+  std::vector<cv::Mat> _min;
+  std::vector<cv::Mat> _max;
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_MASK_PYRAMID_H
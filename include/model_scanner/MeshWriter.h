@@ -0,0 +1,63 @@
+#ifndef MODEL_SCANNER_MESH_WRITER_H
+#define MODEL_SCANNER_MESH_WRITER_H
+
+#include <glm/vec3.hpp>
+#include <string>
+#include <vector>
+#include <model_scanner/ThreadPool.h>
+
+namespace model_scanner {
+
+// Writes quads on an integer grid or indexed triangles as binary STL, or as
+// binary PLY or OBJ with the shared corners written once
+class MeshWriter {
+public:
+  enum Format { STL, PLY, OBJ };
+
+  // Corners go counterclockwise seen from outside
+  struct Quad {
+    glm::ivec3 corners[4];
+    glm::ivec3 normal;
+  };
+
+  // Quad corners are placed at origin + cellSize * corner
+  MeshWriter(ThreadPool& pool, glm::vec3 origin = glm::vec3(0.0f),
+             glm::vec3 cellSize = glm::vec3(1.0f));
+
+  bool write(const std::string& filename, const std::vector<Quad>& quads);
+  // Three vertex indices per triangle
+  bool write(const std::string& filename,
+             const std::vector<glm::vec3>& vertices,
+             const std::vector<uint32_t>& triangles);
+
+  // By extension, STL when it is not .ply or .obj
+  static Format formatFor(const std::string& filename);
+
+private:
+  ThreadPool& _pool;
+  glm::vec3 _origin;
+  glm::vec3 _cellSize;
+
+  bool writeStl(const std::string& filename, const std::vector<Quad>& quads);
+  bool writeStl(const std::string& filename,
+                const std::vector<glm::vec3>& vertices,
+                const std::vector<uint32_t>& triangles);
+  bool writePly(const std::string& filename,
+                const std::vector<glm::vec3>& vertices,
+                const std::vector<uint32_t>& triangles);
+  bool writeObj(const std::string& filename,
+                const std::vector<glm::vec3>& vertices,
+                const std::vector<uint32_t>& triangles);
+  void indexCorners(const std::vector<Quad>& quads,
+                    std::vector<glm::vec3>& vertices,
+                    std::vector<uint32_t>& triangles);
+  glm::vec3 position(const glm::ivec3& corner) const;
+
+  static constexpr size_t STL_HEADER_SIZE = 84;
+  static constexpr size_t STL_TRIANGLE_SIZE = 50;
+  static constexpr size_t CHUNK_SIZE = 16384;
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_MESH_WRITER_H
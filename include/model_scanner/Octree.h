@@ -6,45 +6,156 @@
 #include <glm/vec4.hpp>
 #include <glm/vec3.hpp>
 #include <vector>
-#include <array>
 #include <string>
 #include <fstream>
+#include <model_scanner/MeshWriter.h>
 
 namespace model_scanner {
 
 class Octree {
 public:
+  static constexpr int MAX_DEPTH = 15;
+  static constexpr uint32_t REFINE_MIN_SAMPLES = 64;
+  // Set in total once a node is decided, see freeze()
+  static constexpr uint32_t FROZEN = 0x80000000u;
+
   Octree();
-  Octree(glm::vec4 minPoint, glm::vec4 maxPoint, int depth);
+  Octree(glm::vec4 minPoint, glm::vec4 maxPoint, int depth,
+         bool sparse = false);
   void clear();
+  void refine(float threshold, uint32_t minSamples = REFINE_MIN_SAMPLES);
+  void freeze(float threshold, uint32_t minSamples = REFINE_MIN_SAMPLES);
+  bool isSparse() const;
   void update();
   void bindData();
   void bindSubData();
-  void write(const std::string& filename, float threshold);
+  void write(const std::string& filename, float threshold,
+             bool mergeFaces = false, size_t numThreads = 0);
+  bool save(const std::string& filename) const;
+  bool load(const std::string& filename);
+  // Adds the counters of an octree of the same volume to this one
+  bool merge(const Octree& other);
+  bool sameVolume(const Octree& other) const;
+  // Deals the subtrees at SHARD_DEPTH out round robin to numShards workers
+  // and freezes all but those of shard, so nothing carves or allocates
+  // them. The levels above are carved by every shard alike.
+  void restrictToShard(size_t shard, size_t numShards);
+  // Takes the subtrees of shard over from an octree restricted to it
+  bool stitch(const Octree& other, size_t shard, size_t numShards);
+
+  static constexpr int SHARD_DEPTH = 2;
 
 private:
-  struct alignas(16) Header {
+  friend class CpuCarver;
+  friend class VoxelCarver;
+  friend class OctreeFreeze;
+  friend class OctreeReduction;
+  friend class OctreeSync;
+  friend class SurfaceExtractor;
+
+  // Followed in checkpoint files by hits[size], total[size] and, for
+  // sparse trees, children[size] and freeBlocks[numFreeBlocks]. Frozen
+  // nodes keep FROZEN set in total.
+  struct FileHeader {
+    char magic[8];
+    uint32_t version;
     uint32_t depth;
-    uint32_t size;
-    uint32_t _unused[2];
+    uint32_t sparse;
+    uint32_t counterBits;
+    uint64_t size;
+    uint64_t numFreeBlocks;
+    float minPoint[4];
+    float maxPoint[4];
   };
 
-  struct alignas(16) Node {
-    uint32_t hits;
-    uint32_t total;
+  // Followed in the SSBO by hits[size], total[size] and, for sparse trees,
+  // children[size]
+  struct alignas(16) Header {
     uint32_t depth;
+    uint32_t size;
+    uint32_t sparse;
     uint32_t _unused;
     glm::vec4 minPoint;
     glm::vec4 maxPoint;
   };
 
+  struct Box {
+    glm::vec3 minPoint;
+    glm::vec3 maxPoint;
+
+    Box child(size_t octant) const;
+  };
+
+  // A node written as a whole cube, by its cell position at its depth,
+  // with a bit for every face that is not hidden by a solid neighbor
+  struct Cube {
+    int32_t x, y, z;
+    int depth;
+    uint8_t faces;
+  };
+
+  struct Subtree {
+    size_t idx;
+    Cube cell;
+  };
+
+  // An exposed face of a cube, by its position in the plane of the faces
+  // of cubes at the same depth, facing the same way and at the same
+  // coordinate along the face normal
+  struct FaceCell {
+    uint64_t plane;
+    int32_t u, v;
+  };
+
   Header _header;
-  std::vector<Node> _nodeList;
+  std::vector<uint32_t> _hits;
+  std::vector<uint32_t> _total;
+  std::vector<uint32_t> _children;
+  std::vector<uint32_t> _freeBlocks;
+  bool _sparse;
+  size_t _boundSize;
+  size_t _shard;
+  size_t _numShards;
 
-  std::vector<std::array<glm::vec3, 3>> writeNode(size_t idx, float threshold);
-  size_t search(glm::vec3 point, size_t current = 0);
-  bool isPartOf(size_t idx, float threshold);
+  void collectCubes(size_t idx, const Cube& cell, float threshold,
+                    std::vector<Cube>& cubes,
+                    std::vector<Subtree>* subtrees) const;
+  uint8_t visibleFaces(const Cube& cube, float threshold) const;
+  std::vector<MeshWriter::Quad> faceQuads(
+      const std::vector<std::vector<Cube>>& parts, ThreadPool& pool) const;
+  std::vector<MeshWriter::Quad> mergedQuads(
+      const std::vector<std::vector<Cube>>& parts, ThreadPool& pool) const;
+  bool isSolidAt(int32_t x, int32_t y, int32_t z, int depth,
+                 float threshold) const;
+  bool isPartOf(size_t idx, float threshold) const;
+  bool isFrozen(size_t idx) const;
+  uint32_t total(size_t idx) const;
+  size_t firstChild(size_t idx, int depth) const;
+  Box rootBox() const;
+  void allocateChildren(size_t idx);
+  void freeChildren(size_t idx);
+  void refineNode(size_t idx, int depth, float threshold,
+                  uint32_t minSamples);
+  bool freezeNode(size_t idx, int depth, float threshold,
+                  uint32_t minSamples);
+  void mergeNode(size_t idx, int depth, const Octree& other,
+                 size_t otherIdx);
+  void addCounts(size_t idx, int depth, uint32_t hits, uint32_t total);
+  void sumCounts(size_t idx, uint32_t hits, uint32_t total);
+  void copyNode(size_t idx, int depth, const Octree& other, size_t otherIdx);
+  size_t bufferSize() const;
+  static bool validLinks(const uint32_t* children, const uint32_t* freeBlocks,
+                         size_t size, size_t numFreeBlocks, int depth);
   static size_t depthToSize(int depth);
+
+  static constexpr int SPARSE_BASE_DEPTH = 3;
+  static constexpr float CARVED_RATIO = 0.05;
+  static constexpr float FREEZE_MARGIN = 0.05;
+  static constexpr uint32_t FREEZE_SAMPLE_FACTOR = 4;
+  static constexpr int WRITE_SPLIT_DEPTH = 2;
+  static constexpr char FILE_MAGIC[8] = { 'M', 'S', 'O', 'C',
+                                          'T', 'R', 'E', 'E' };
+  static constexpr uint32_t FILE_VERSION = 1;
 };
 
 }  // namespace model_scanner
@@ -0,0 +1,38 @@
+#ifndef MODEL_SCANNER_OCTREE_FREEZE_H
+#define MODEL_SCANNER_OCTREE_FREEZE_H
+
+#include <GL/glew.h>
+#include <model_scanner/Octree.h>
+
+namespace model_scanner {
+
+// Freezes the decided nodes of a dense GPU carved octree where its counters
+// are, level by level from the leaves up, with the same rules as
+// Octree::freeze. The CPU copy only learns about them with the next full
+// readback. Inner nodes have to be reduced first, see OctreeReduction.
+class OctreeFreeze {
+public:
+  OctreeFreeze(const Octree& octree);
+
+  void initGL(GLuint program);
+  // octreeSsbo must be bound to GL_SHADER_STORAGE_BUFFER
+  void run(GLuint octreeSsbo, float threshold,
+           uint32_t minSamples = Octree::REFINE_MIN_SAMPLES);
+
+private:
+  const Octree& _octree;
+  GLuint _prog;
+  GLuint _firstLoc;
+  GLuint _lastLoc;
+  GLuint _leavesLoc;
+  GLuint _thresholdLoc;
+  GLuint _solidRatioLoc;
+  GLuint _carvedRatioLoc;
+  GLuint _minSamplesLoc;
+
+  static constexpr GLuint WORKGROUP_SIZE = 256;
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_OCTREE_FREEZE_H
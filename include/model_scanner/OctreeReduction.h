@@ -0,0 +1,40 @@
+#ifndef MODEL_SCANNER_OCTREE_REDUCTION_H
+#define MODEL_SCANNER_OCTREE_REDUCTION_H
+
+#include <GL/glew.h>
+#include <model_scanner/Octree.h>
+
+namespace model_scanner {
+
+// The carving shader only counts the leaves a ray passes through, so rays
+// do not all contend on the same few nodes near the root. This pass sums
+// the counters of every node's children up into it, bottom up, and only
+// runs when something reads the inner nodes and carving happened since.
+//
+// An inner node's ratio is then that of all rays through its leaves, not of
+// the rays through it.
+class OctreeReduction {
+public:
+  OctreeReduction(const Octree& octree);
+
+  void initGL(GLuint program);
+  // octreeSsbo must be bound to GL_SHADER_STORAGE_BUFFER
+  void run(GLuint octreeSsbo);
+  // The leaves were carved or the counters uploaded
+  void invalidate();
+
+private:
+  const Octree& _octree;
+  GLuint _prog;
+  GLuint _firstLoc;
+  GLuint _lastLoc;
+  bool _reduced;
+
+  void dispatch(size_t first, size_t last);
+
+  static constexpr GLuint WORKGROUP_SIZE = 256;
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_OCTREE_REDUCTION_H
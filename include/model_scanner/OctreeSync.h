@@ -0,0 +1,57 @@
+#ifndef MODEL_SCANNER_OCTREE_SYNC_H
+#define MODEL_SCANNER_OCTREE_SYNC_H
+
+#include <GL/glew.h>
+#include <vector>
+#include <model_scanner/Octree.h>
+
+namespace model_scanner {
+
+// Brings the CPU copy of a GPU carved octree up to date for writing it out,
+// without reading back the whole node array. A compute pass collects only
+// the nodes that became solid or stopped being solid since the last sync,
+// and they are read back once a fence says the pass is done.
+//
+// Synced nodes get a count of 1/1 when solid and 0/1 otherwise, which is
+// all Octree::write looks at. FROZEN bits are not synced. Anything that needs
+// the real counts or the nodes frozen on the GPU has to call Octree::update
+// and then reset().
+class OctreeSync {
+public:
+  OctreeSync(Octree& octree);
+
+  void initGL(GLuint program);
+  // octreeSsbo must be bound to GL_SHADER_STORAGE_BUFFER
+  void start(GLuint octreeSsbo, float threshold);
+  // Applies the changes if the last start() is done and returns whether it
+  // was
+  bool poll();
+  void wait();
+  bool pending() const;
+  // The next sync sends every solid node, for after the CPU copy changed.
+  // A pending sync is dropped, which is returned.
+  bool reset();
+  // Deletes a pending fence while the GL context is still current
+  void release();
+
+private:
+  Octree& _octree;
+  GLuint _prog;
+  GLuint _thresholdLoc;
+  GLuint _solidSsbo;
+  GLuint _changeSsbo;
+  GLsync _fence;
+  size_t _size;
+  bool _full;
+  bool _pendingFull;
+  std::vector<uint32_t> _changes;
+
+  void apply();
+
+  static constexpr GLuint WORKGROUP_SIZE = 256;
+  static constexpr uint32_t SOLID_BIT = 0x80000000u;
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_OCTREE_SYNC_H
@@ -0,0 +1,35 @@
+#ifndef MODEL_SCANNER_PREVIEW_SCHEDULER_H
+#define MODEL_SCANNER_PREVIEW_SCHEDULER_H
+
+#include <cstddef>
+#include <glm/matrix.hpp>
+
+namespace model_scanner {
+
+// Decides when a preview of the octree is worth drawing again. A view is
+// redrawn at most every interval frames, and only once it has moved or at
+// least interval frames have been carved since it was last drawn. Otherwise
+// the last image is shown again.
+class PreviewScheduler {
+public:
+  PreviewScheduler(size_t interval = 1);
+
+  // Called once per frame and view, returns whether to draw it
+  bool due(const glm::mat4& pose);
+  void carved();
+  // The octree changed in another way, e.g. it was cleared
+  void invalidate();
+
+private:
+  size_t _interval;
+  size_t _framesSince;
+  size_t _carvedSince;
+  glm::mat4 _pose;
+  bool _stale;
+
+  static constexpr float POSE_EPSILON = 1e-3;
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_PREVIEW_SCHEDULER_H
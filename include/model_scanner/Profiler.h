@@ -0,0 +1,132 @@
+#ifndef MODEL_SCANNER_PROFILER_H
+#define MODEL_SCANNER_PROFILER_H
+
+#include <GL/glew.h>
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace model_scanner {
+
+// Collects how long every stage of a frame takes, on the CPU with scoped
+// timers and on the GPU with GL_TIME_ELAPSED queries, prints the median and
+// 99th percentile of each now and then and can record a Chrome trace. The
+// PROFILE_* macros below only do anything when built with
+// MODEL_SCANNER_PROFILE.
+class Profiler {
+public:
+  enum Stage {
+    CAPTURE,
+    UNDISTORT,
+    DETECT,
+    UPLOAD,
+    CARVE,
+    READBACK,
+    FRAME,
+    GPU_UNDISTORT,
+    GPU_RENDER,
+    GPU_CARVE,
+    GPU_PREVIEW,
+    GPU_READBACK,
+    NUM_STAGES
+  };
+  using Clock = std::chrono::steady_clock;
+
+  static Profiler& instance();
+
+  void record(Stage stage, Clock::time_point start, Clock::time_point end);
+  // Results are read two frames later, once they are available, so the
+  // queries never stall the pipeline
+  void beginGpu(Stage stage);
+  void endGpu(Stage stage);
+  void endFrame();
+
+  void startTrace();
+  bool stopTrace(const std::string& filename);
+  bool tracing() const;
+
+private:
+  static constexpr size_t WINDOW_SIZE = 256;
+  static constexpr size_t SUMMARY_INTERVAL = 120;
+  static constexpr size_t MAX_TRACE_EVENTS = 1 << 20;
+  static constexpr int GPU_THREAD = 0;
+
+  struct Samples {
+    std::array<double, WINDOW_SIZE> ms;
+    size_t count = 0;
+  };
+
+  struct GpuQueries {
+    GLuint queries[2] = { 0, 0 };
+    bool issued[2] = { false, false };
+    Clock::time_point started[2];
+    size_t next = 0;
+  };
+
+  struct Event {
+    Stage stage;
+    double startUs;
+    double durationUs;
+    int thread;
+  };
+
+  Profiler();
+
+  void addSample(Stage stage, Clock::time_point start, double ms,
+                 int thread);
+  void printSummary();
+
+  static int threadIndex();
+
+  mutable std::mutex _mutex;
+  Clock::time_point _epoch;
+  Clock::time_point _lastFrame;
+  size_t _frames;
+  std::array<Samples, NUM_STAGES> _samples;
+  std::array<GpuQueries, NUM_STAGES> _gpu;
+  bool _tracing;
+  std::vector<Event> _events;
+};
+
+class ScopedTimer {
+public:
+  ScopedTimer(Profiler::Stage stage)
+    : _stage(stage), _start(Profiler::Clock::now()) {}
+  ~ScopedTimer() {
+    Profiler::instance().record(_stage, _start, Profiler::Clock::now());
+  }
+
+private:
+  Profiler::Stage _stage;
+  Profiler::Clock::time_point _start;
+};
+
+class ScopedGpuTimer {
+public:
+  ScopedGpuTimer(Profiler::Stage stage) : _stage(stage) {
+    Profiler::instance().beginGpu(_stage);
+  }
+  ~ScopedGpuTimer() { Profiler::instance().endGpu(_stage); }
+
+private:
+  Profiler::Stage _stage;
+};
+
+}  // namespace model_scanner
+
+#ifdef MODEL_SCANNER_PROFILE
+#define PROFILE_SCOPE(stage) \
+  ::model_scanner::ScopedTimer profileScope(::model_scanner::Profiler::stage)
+#define PROFILE_GPU_SCOPE(stage)                   \
+  ::model_scanner::ScopedGpuTimer profileGpuScope( \
+      ::model_scanner::Profiler::stage)
+#define PROFILE_FRAME() ::model_scanner::Profiler::instance().endFrame()
+#else
+#define PROFILE_SCOPE(stage)
+#define PROFILE_GPU_SCOPE(stage)
+#define PROFILE_FRAME()
+#endif
+
+#endif  // MODEL_SCANNER_PROFILER_H
@@ -0,0 +1,37 @@
+#ifndef MODEL_SCANNER_RAY_BOX_H
+#define MODEL_SCANNER_RAY_BOX_H
+
+#include <cstdint>
+#include <glm/vec3.hpp>
+
+namespace model_scanner {
+
+// Bounds of the eight children of an octree node, child i taking the upper
+// half along axis j when bit j of i is set
+struct alignas(32) ChildBounds {
+  float minX[8];
+  float minY[8];
+  float minZ[8];
+  float maxX[8];
+  float maxY[8];
+  float maxZ[8];
+
+  static ChildBounds split(const glm::vec3& minPoint,
+                           const glm::vec3& maxPoint);
+};
+
+// Slab test of a ray against all eight children at once. Returns a bitmask
+// of the children the ray hits in front of its origin and writes the entry
+// distance of each child to tNear.
+uint32_t intersectChildren(const glm::vec3& origin, const glm::vec3& invDir,
+                           const ChildBounds& bounds, float tNear[8]);
+
+bool intersectBox(const glm::vec3& origin, const glm::vec3& invDir,
+                  const glm::vec3& minPoint, const glm::vec3& maxPoint,
+                  float& tNear);
+
+const char* intersectChildrenIsa();
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_RAY_BOX_H
@@ -0,0 +1,208 @@
+#ifndef MODEL_SCANNER_SCANNER_H
+#define MODEL_SCANNER_SCANNER_H
+
+#include <GL/glew.h>
+#include <GL/glut.h>
+#include <memory>
+#include <glm/matrix.hpp>
+#include <model_scanner/Camera.h>
+#include <model_scanner/AprilTagDetector.h>
+#include <model_scanner/Octree.h>
+#include <model_scanner/OctreeFreeze.h>
+#include <model_scanner/OctreeReduction.h>
+#include <model_scanner/OctreeSync.h>
+#include <model_scanner/Carver.h>
+#include <model_scanner/FramePipeline.h>
+#include <model_scanner/KeyframeSelector.h>
+#include <model_scanner/PreviewScheduler.h>
+#include <model_scanner/TextureStreamer.h>
+
+namespace model_scanner {
+
+class Scanner {
+public:
+  struct Options {
+    std::string deviceName = "/dev/video0";
+    std::string calibrationFile = "";
+    std::string outFileName = "model.stl";
+    int octreeDepth = 4;
+    bool sparseOctree = false;
+    bool cpuCarving = false;
+    bool voxelCarving = false;
+    bool asyncCapture = false;
+    bool gpuUndistort = false;
+    bool streamUploads = false;
+    bool tagTracking = false;
+    FramePipeline::Policy framePolicy = FramePipeline::AUTO;
+    size_t numThreads = 0;
+    size_t autosaveInterval = 0;
+    bool mergeFaces = false;
+    bool smoothSurface = false;
+    std::string checkpointFile = "";
+    bool freezeNodes = false;
+    std::string traceFile = "";
+    // Frames between preview redraws, and how much smaller they are drawn
+    size_t previewInterval = 1;
+    int previewScale = 1;
+    bool preview = true;
+    // Further cameras around the object, each with its own calibration,
+    // carving into the same octree
+    std::vector<std::string> extraDeviceNames;
+    std::vector<std::string> extraCalibrationFiles;
+    // Only carves one of numShards parts of the octree and writes no model,
+    // only the checkpoint, see ShardCoordinator
+    size_t shard = 0;
+    size_t numShards = 1;
+    // Skips frames seen from within keyframeAngle degrees of one already
+    // carved, see KeyframeSelector. 0 carves every frame.
+    float keyframeAngle = 0.0;
+    float keyframeDistance = 0.1;
+    float keyframeGain = 0.25;
+    // Finds tags in the decoder's Y plane, see Camera::captureLuma
+    bool lumaCapture = false;
+  };
+
+  // Share of a node's samples that must see it solid for it to be solid
+  static constexpr float DEFAULT_THRESHOLD = 0.9;
+
+  Scanner(const Options& options);
+
+  bool initGL();
+  bool render0();
+  void render1();
+  void render2();
+  void render3();
+  void writeModel();
+  void clear();
+  // Frees what cannot be freed without a current GL context, before the
+  // context goes away
+  void releaseGL();
+
+  const Camera& camera() const;
+  const KeyframeSelector& keyframes() const;
+  GLuint texture(size_t idx) const;
+
+private:
+  // A further camera, decoded, undistorted and detected on its own threads
+  struct Source {
+    std::unique_ptr<Camera> camera;
+    std::unique_ptr<AprilTagDetector> detector;
+    std::unique_ptr<FramePipeline> pipeline;
+    glm::mat4 projMatrix;
+    glm::mat4 pose;
+    bool keyframe;
+    cv::Mat frame;
+    GLuint tex;
+    // The mask is carved into maskTex through frameBuffer
+    GLuint maskTex;
+    GLuint frameBuffer;
+    GLuint depthRenderBuffer;
+  };
+
+  Camera _camera;
+  AprilTagDetector _aprilTagDetector;
+
+  GLuint _tex[4];
+  GLuint _frameBuffers[4];
+  GLuint _depthRenderBuffers[4];
+
+  glm::mat4 _projMatrix;
+  float _threshold;
+  Octree _octree;
+  OctreeReduction _octreeReduction;
+  OctreeFreeze _octreeFreeze;
+  OctreeSync _octreeSync;
+  std::string _outFileName;
+  bool _mergeFaces;
+  bool _smoothSurface;
+  std::string _checkpointFile;
+  size_t _framesSinceCheckpoint;
+  bool _freezeNodes;
+  bool _sharded;
+  std::unique_ptr<Carver> _carver;
+  // Declared first so the pipeline stops writing before it is unmapped,
+  // see releaseGL
+  TextureStreamer _streamer;
+  std::unique_ptr<FramePipeline> _pipeline;
+  std::vector<Source> _sources;
+  cv::Mat _rawFrame;
+  cv::Mat _greyFrame;
+  cv::Mat _bgrFrame;
+  cv::Mat _frame;
+  cv::Mat _uploadFrame;
+  glm::mat4 _pose;
+  KeyframeSelector _keyframes;
+  bool _keyframe;
+  size_t _framesSinceRefine;
+  size_t _autosaveInterval;
+  size_t _framesSinceSave;
+  size_t _uploadSlot;
+  bool _asyncCapture;
+  FramePipeline::Policy _framePolicy;
+  bool _gpuUndistort;
+  bool _streamUploads;
+  bool _preview;
+  int _previewWidth;
+  int _previewHeight;
+  PreviewScheduler _cameraPreview;
+  PreviewScheduler _fixedPreview;
+
+  GLuint _prog;
+  GLuint _shaderMaskModeLoc;
+  GLuint _shaderTexLoc;
+  GLuint _shaderScreenSizeLoc;
+  GLuint _shaderinvProjLoc;
+  GLuint _shaderInvModelViewLoc;
+  GLuint _shaderThresholdLoc;
+  GLuint _shaderOctreeSsbo;
+  GLuint _compactProg;
+  GLuint _reduceProg;
+  GLuint _freezeProg;
+
+  GLuint _rawTex;
+  GLuint _undistortMapTex;
+  GLuint _undistortProg;
+  GLuint _undistortTexLoc;
+  GLuint _undistortMapLoc;
+  GLuint _undistortScreenSizeLoc;
+  bool _glReady;
+
+  bool initUndistortGL();
+  void startPipeline();
+  void nextSourceFrames();
+  bool selectKeyframe(const glm::mat4& pose, const cv::Mat& grey,
+                      float margin);
+  void carveGPU(GLuint tex, const glm::mat4& projMatrix,
+                const glm::mat4& modelView, int width, int height);
+  void refineOctree();
+  void uploadOctree();
+  void autosave();
+  void saveModel();
+  void resume();
+  void checkpoint();
+  void readOctree();
+  void reduceOctree();
+  void resetSync();
+  void carved();
+
+  static glm::mat4 projection(const Camera& camera);
+  static void initRenderTarget(GLuint tex, GLuint frameBuffer,
+                               GLuint depthRenderBuffer, int width,
+                               int height);
+  static void initTexture(GLuint tex, int width, int height);
+  static void uploadTexture(GLuint tex, const cv::Mat& image, GLenum format);
+  static GLuint loadProgram(const std::string& filename,
+                            GLenum type = GL_FRAGMENT_SHADER);
+  static std::string loadFile(const std::string& filename);
+
+  static constexpr double TAG_SIZE = 0.08333333333;
+  static constexpr double SQUARE_SIZE = 0.05;
+  static constexpr glm::vec3 OFFSET{ 0.0, -0.125, SQUARE_SIZE };
+  static constexpr size_t REFINE_INTERVAL = 30;
+  static constexpr size_t STREAM_SLOTS = 3;
+  static constexpr size_t CHECKPOINT_INTERVAL = 300;
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_SCANNER_H
@@ -0,0 +1,37 @@
+#ifndef MODEL_SCANNER_SHARD_COORDINATOR_H
+#define MODEL_SCANNER_SHARD_COORDINATOR_H
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <model_scanner/Scanner.h>
+
+namespace model_scanner {
+
+// Carves in several local processes at once. Every worker runs the scanner
+// in batch mode over the whole source but only carves its own shard of the
+// octree, see Octree::restrictToShard, pinned to its own share of the CPUs,
+// and writes its counters to a checkpoint. The shards are then stitched
+// together into one octree and written as the model.
+class ShardCoordinator {
+public:
+  // args are the command line the workers are started with, besides the
+  // options that make them workers
+  ShardCoordinator(const Scanner::Options& options, size_t numShards,
+                   const std::vector<std::string>& args);
+
+  int run();
+
+private:
+  Scanner::Options _options;
+  size_t _numShards;
+  std::vector<std::string> _args;
+
+  pid_t spawn(size_t shard) const;
+  bool stitch(Octree& octree) const;
+  std::string shardFile(size_t shard) const;
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_SHARD_COORDINATOR_H
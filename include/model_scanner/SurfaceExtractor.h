@@ -0,0 +1,54 @@
+#ifndef MODEL_SCANNER_SURFACE_EXTRACTOR_H
+#define MODEL_SCANNER_SURFACE_EXTRACTOR_H
+
+#include <glm/vec3.hpp>
+#include <string>
+#include <vector>
+#include <model_scanner/Octree.h>
+#include <model_scanner/ThreadPool.h>
+
+namespace model_scanner {
+
+// Writes a smooth surface through the hits / total ratio of the octree at
+// its finest level, where it crosses the threshold. Every cell of samples
+// the surface passes through gets one vertex, at the mean of where the
+// surface crosses its edges, and every crossed edge a quad between the
+// four cells around it (surface nets).
+class SurfaceExtractor {
+public:
+  SurfaceExtractor(const Octree& octree, size_t numThreads = 0);
+
+  bool write(const std::string& filename, float threshold);
+
+private:
+  // A range of cell layers along z. Triangles that use a vertex in the
+  // last layer of the slab before refer to it with PREVIOUS_SLAB and its
+  // cell in that layer.
+  struct Slab {
+    int32_t begin;
+    int32_t end;
+    std::vector<glm::vec3> vertices;
+    std::vector<uint32_t> triangles;
+    std::vector<int32_t> lastLayer;
+  };
+
+  const Octree& _octree;
+  ThreadPool _pool;
+  // Samples along each axis inside the octree, one more is added outside
+  // on either side so the surface is closed
+  int32_t _size;
+  glm::vec3 _origin;
+  glm::vec3 _cellSize;
+
+  void extractSlab(Slab& slab, float threshold) const;
+  void sampleLayer(int32_t z, float threshold,
+                   std::vector<float>& layer) const;
+  float sample(int32_t x, int32_t y, int32_t z) const;
+
+  static constexpr uint32_t PREVIOUS_SLAB = 0x80000000u;
+  static constexpr size_t SLABS_PER_THREAD = 4;
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_SURFACE_EXTRACTOR_H
@@ -0,0 +1,41 @@
+#ifndef MODEL_SCANNER_TEXTURE_STREAMER_H
+#define MODEL_SCANNER_TEXTURE_STREAMER_H
+
+#include <GL/glew.h>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace model_scanner {
+
+// Ring of slots in one persistently mapped pixel buffer. Frames are written
+// straight into a slot and copied into a texture by the GPU, and each slot
+// is fenced so it is only written again once that copy is done.
+class TextureStreamer {
+public:
+  TextureStreamer();
+
+  bool init(size_t slotSize, size_t numSlots);
+  bool ready() const;
+  size_t size() const;
+  size_t slotSize() const;
+  uint8_t* slot(size_t idx) const;
+
+  // Waits until the GPU has read slot idx
+  void wait(size_t idx);
+  // Copies slot idx into the existing storage of tex
+  void upload(size_t idx, GLuint tex, int width, int height, GLenum format);
+  // Unmaps and deletes the buffer. Needs the GL context to still be current,
+  // so it is not left to the destructor.
+  void release();
+
+private:
+  GLuint _pbo;
+  uint8_t* _data;
+  size_t _slotSize;
+  std::vector<GLsync> _fences;
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_TEXTURE_STREAMER_H
@@ -0,0 +1,50 @@
+#ifndef MODEL_SCANNER_THREAD_POOL_H
+#define MODEL_SCANNER_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace model_scanner {
+
+class ThreadPool {
+public:
+  using Task = std::function<void(size_t idx, size_t worker)>;
+
+  ThreadPool(size_t numThreads = 0);
+  ~ThreadPool();
+
+  size_t size() const;
+  void parallelFor(size_t count, const Task& task);
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<size_t> indices;
+  };
+
+  std::vector<std::thread> _threads;
+  std::vector<std::unique_ptr<Queue>> _queues;
+
+  std::mutex _mutex;
+  std::condition_variable _start;
+  std::condition_variable _done;
+  const Task* _task;
+  size_t _generation;
+  std::atomic<size_t> _remaining;
+  size_t _active;
+  bool _stop;
+
+  void workerLoop(size_t worker);
+  bool pop(size_t worker, size_t& idx);
+  bool steal(size_t worker, size_t& idx);
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_THREAD_POOL_H
@@ -0,0 +1,63 @@
+#ifndef MODEL_SCANNER_VOXEL_CARVER_H
+#define MODEL_SCANNER_VOXEL_CARVER_H
+
+#include <vector>
+#include <model_scanner/Carver.h>
+#include <model_scanner/MaskPyramid.h>
+#include <model_scanner/Octree.h>
+#include <model_scanner/ThreadPool.h>
+
+namespace model_scanner {
+
+// Projects octree nodes into the frame instead of casting rays through it.
+// A node whose footprint lies entirely inside or outside the silhouette is
+// decided with one pyramid lookup and its counts are deferred to its
+// subtree, so only nodes on the silhouette's boundary are descended into.
+// Every node is counted once per frame rather than once per pixel.
+class VoxelCarver : public Carver {
+public:
+  VoxelCarver(Octree& octree, size_t numThreads = 0);
+
+  void carve(const cv::Mat& frame, const glm::mat4& proj,
+             const glm::mat4& modelView) override;
+  void flush() override;
+  uint32_t refineMinSamples() const override;
+
+private:
+  struct Entry {
+    uint32_t idx;
+    int depth;
+    glm::uvec3 pos;
+  };
+
+  // Clip space position of the root's min corner and of its edges
+  struct Projection {
+    glm::vec4 origin;
+    glm::vec4 axes[3];
+    float width;
+    float height;
+  };
+
+  Octree& _octree;
+  ThreadPool _pool;
+  MaskPyramid _mask;
+  std::vector<uint32_t> _deferredHits;
+  std::vector<uint32_t> _deferredTotal;
+
+  void traverse(std::vector<Entry>& stack, const Projection& proj,
+                std::vector<Entry>* split);
+  bool footprint(const Entry& entry, const Projection& proj,
+                 cv::Rect& rect, bool& clipped) const;
+  void defer(size_t idx, size_t children, uint32_t hits, uint32_t total);
+  void pushDown(size_t idx, size_t children, int depth);
+  void flushNode(size_t idx, int depth);
+  void pushChildren(const Entry& entry, size_t children,
+                    std::vector<Entry>& stack) const;
+
+  static constexpr int SPLIT_DEPTH = 2;
+  static constexpr uint32_t REFINE_MIN_FRAMES = 8;
+};
+
+}  // namespace model_scanner
+
+#endif  // MODEL_SCANNER_VOXEL_CARVER_H
@@ -0,0 +1,48 @@
+#version 430
+
+layout(local_size_x = 256) in;
+
+// Must match OctreeBuffer in shader.glsl
+layout(std430, binding = 0) readonly buffer OctreeBuffer {
+  uint depth;
+  uint size;
+  uint sparse;
+  uint _unused;
+  vec4 minPoint;
+  vec4 maxPoint;
+  uint data[];
+}
+octree;
+
+// One bit per node, set when it was solid at the last sync
+layout(std430, binding = 1) buffer SolidBuffer {
+  uint solid[];
+};
+
+// Nodes whose state changed, with the new state in the top bit
+layout(std430, binding = 2) buffer ChangeBuffer {
+  uint count;
+  uint nodes[];
+};
+
+#define HITS(idx) octree.data[idx]
+#define TOTAL(idx) octree.data[octree.size + (idx)]
+// Must match Octree::FROZEN
+#define FROZEN 0x80000000u
+
+uniform float threshold;
+
+void main() {
+  uint idx = gl_GlobalInvocationID.x;
+  if (idx >= octree.size)
+    return;
+
+  bool isSolid = float(HITS(idx)) / float(TOTAL(idx) & ~FROZEN) >= threshold;
+  uint bit = 1u << (idx & 31u);
+  bool wasSolid = (solid[idx >> 5] & bit) != 0u;
+  if (isSolid == wasSolid)
+    return;
+
+  atomicXor(solid[idx >> 5], bit);
+  nodes[atomicAdd(count, 1u)] = idx | (isSolid ? 0x80000000u : 0u);
+}
@@ -0,0 +1,54 @@
+#version 430
+
+layout(local_size_x = 256) in;
+
+// Must match OctreeBuffer in shader.glsl
+layout(std430, binding = 0) buffer OctreeBuffer {
+  uint depth;
+  uint size;
+  uint sparse;
+  uint _unused;
+  vec4 minPoint;
+  vec4 maxPoint;
+  uint data[];
+}
+octree;
+
+#define HITS(idx) octree.data[idx]
+#define TOTAL(idx) octree.data[octree.size + (idx)]
+// Must match Octree::FROZEN
+#define FROZEN 0x80000000u
+
+// Nodes [first, last) of one level of a dense tree, see Octree::freeze
+uniform uint first;
+uniform uint last;
+uniform bool leaves;
+uniform float threshold;
+uniform float solidRatio;
+uniform float carvedRatio;
+uniform uint minSamples;
+
+float ratio(uint idx) {
+  return float(HITS(idx)) / float(max(TOTAL(idx) & ~FROZEN, 1u));
+}
+
+void main() {
+  uint idx = first + gl_GlobalInvocationID.x;
+  if (idx >= last || (TOTAL(idx) & FROZEN) != 0u)
+    return;
+
+  if (leaves) {
+    float r = ratio(idx);
+    if ((TOTAL(idx) & ~FROZEN) >= minSamples &&
+        (r >= solidRatio || r < carvedRatio))
+      TOTAL(idx) |= FROZEN;
+    return;
+  }
+
+  // Inner nodes are frozen once all their children are frozen and carved
+  uint c = 8 * idx + 1;
+  for (uint i = 0; i < 8; ++i)
+    if ((TOTAL(c + i) & FROZEN) == 0u || ratio(c + i) >= threshold)
+      return;
+  TOTAL(idx) |= FROZEN;
+}
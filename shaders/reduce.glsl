@@ -0,0 +1,64 @@
+#version 430
+
+layout(local_size_x = 256) in;
+
+// Must match OctreeBuffer in shader.glsl
+layout(std430, binding = 0) buffer OctreeBuffer {
+  uint depth;
+  uint size;
+  uint sparse;
+  uint _unused;
+  vec4 minPoint;
+  vec4 maxPoint;
+  uint data[];
+}
+octree;
+
+#define HITS(idx) octree.data[idx]
+#define TOTAL(idx) octree.data[octree.size + (idx)]
+#define CHILDREN(idx) octree.data[2 * octree.size + (idx)]
+// Must match Octree::FROZEN
+#define FROZEN 0x80000000u
+// Eight counts below this add up to less than FROZEN
+#define MAX_CHILD_COUNT (FROZEN / 8u)
+
+// Nodes [first, last) are summed up from their children
+uniform uint first;
+uniform uint last;
+
+uint firstChild(uint idx) {
+  if (octree.sparse != 0)
+    return CHILDREN(idx);
+  return 8 * idx + 1 < octree.size ? 8 * idx + 1 : 0;
+}
+
+void main() {
+  uint idx = first + gl_GlobalInvocationID.x;
+  if (idx >= last)
+    return;
+
+  // Frozen nodes keep the counts they were frozen with
+  if ((TOTAL(idx) & FROZEN) != 0u)
+    return;
+  uint c = firstChild(idx);
+  if (c == 0u || c + 7 >= octree.size)
+    return;
+
+  // Parents add up every leaf below them, so large counts are scaled down
+  // before summing. Only the ratio of hits to total matters and it is kept.
+  uint largest = 0;
+  for (uint i = 0; i < 8; ++i)
+    largest = max(largest, max(HITS(c + i), TOTAL(c + i) & ~FROZEN));
+  uint shift = 0;
+  while ((largest >> shift) >= MAX_CHILD_COUNT)
+    ++shift;
+
+  uint hits = 0;
+  uint total = 0;
+  for (uint i = 0; i < 8; ++i) {
+    hits += HITS(c + i) >> shift;
+    total += (TOTAL(c + i) & ~FROZEN) >> shift;
+  }
+  HITS(idx) = hits;
+  TOTAL(idx) = total;
+}
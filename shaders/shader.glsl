@@ -1,21 +1,13 @@
 #version 430
 
-#define STACK_SIZE (64)
-
-struct OctreeNode {
-  uint hits;
-  uint total;
-  uint depth;
-  uint _unused;
-  vec4 minPoint;
-  vec4 maxPoint;
-};
+// Must match Octree::MAX_DEPTH
+#define MAX_DEPTH (15)
 
 struct Box {
   uint nodeIdx;
-  uint parentIdx;
-  uint childrenIdx[8];
-  uint depth;
+  bool leaf;
+  uint children;
+  uvec4 pos;
   vec4 minPoint;
   vec4 maxPoint;
 };
@@ -23,6 +15,7 @@ struct Box {
 struct Ray {
   vec4 origin;
   vec4 dir;
+  vec4 invDir;
 };
 
 struct RaycastHit {
@@ -31,13 +24,26 @@ struct RaycastHit {
   Ray normal;
 };
 
+// Counters are stored as hits[size], total[size] and, for sparse trees,
+// children[size]. Node bounds are not stored, they follow from the node's
+// cell position (pos.xyz at depth pos.w) below the root bounds.
 layout(std430, binding = 0) volatile buffer OctreeBuffer {
   uint depth;
   uint size;
-  OctreeNode nodes[];
+  uint sparse;
+  uint _unused;
+  vec4 minPoint;
+  vec4 maxPoint;
+  uint data[];
 }
 octree;
 
+#define HITS(idx) octree.data[idx]
+#define TOTAL(idx) octree.data[octree.size + (idx)]
+#define CHILDREN(idx) octree.data[2 * octree.size + (idx)]
+// Must match Octree::FROZEN
+#define FROZEN 0x80000000u
+
 uniform bool maskMode;
 uniform sampler2D image;
 uniform vec2 screenSize;
@@ -47,18 +53,27 @@ uniform float threshold;
 
 out vec4 fragColor;
 
-Box getBox(uint nodeIdx) {
+uint firstChild(uint idx, uint depth) {
+  if (octree.sparse != 0)
+    return CHILDREN(idx);
+  return depth < octree.depth ? 8 * idx + 1 : 0;
+}
+
+uvec4 childPos(uvec4 pos, uint octant) {
+  uvec3 offset = uvec3(octant & 1u, (octant >> 1) & 1u, (octant >> 2) & 1u);
+  return uvec4(2 * pos.xyz + offset, pos.w + 1);
+}
+
+Box getBox(uint nodeIdx, uvec4 pos) {
   uint idx = clamp(nodeIdx, 0, octree.size - 1);
   Box box;
   box.nodeIdx = idx;
-  box.parentIdx = uint((float(idx) - 1.0) / 8.0);
-  for (uint i = 0; i < 8; ++i) {
-    box.childrenIdx[i] = 8 * idx + i + 1;
-    if (box.childrenIdx[i] >= octree.size)
-      box.childrenIdx[i] = idx;
-  }
-  box.minPoint = octree.nodes[idx].minPoint;
-  box.maxPoint = octree.nodes[idx].maxPoint;
+  box.pos = pos;
+  box.children = firstChild(idx, pos.w);
+  box.leaf = box.children == 0 || box.children + 7 >= octree.size;
+  vec4 size = (octree.maxPoint - octree.minPoint) / float(1u << pos.w);
+  box.minPoint = octree.minPoint + vec4(vec3(pos.xyz), 0.0) * size;
+  box.maxPoint = box.minPoint + size;
   return box;
 }
 
@@ -66,101 +81,92 @@ vec4 rayAt(Ray ray, float t) {
   return ray.origin + ray.dir * t;
 }
 
+// Slab test: the ray is inside the box between the last plane it enters and
+// the first plane it leaves. The normal is the entry face, or the exit face
+// when the ray starts inside the box.
 RaycastHit boxIntersect(Box box, Ray ray) {
+  vec3 t0 = (box.minPoint.xyz - ray.origin.xyz) * ray.invDir.xyz;
+  vec3 t1 = (box.maxPoint.xyz - ray.origin.xyz) * ray.invDir.xyz;
+  vec3 tmin = min(t0, t1);
+  vec3 tmax = max(t0, t1);
+  float tNear = max(max(tmin.x, tmin.y), tmin.z);
+  float tFar = min(min(tmax.x, tmax.y), tmax.z);
+
+  bool inside = tNear <= 0.0;
+  float dist = inside ? tFar : tNear;
+  vec3 face = inside ? step(tmax, vec3(tFar)) * sign(ray.dir.xyz)
+                     : -step(vec3(tNear), tmin) * sign(ray.dir.xyz);
+
   RaycastHit hit;
-  hit.dist = 0.0;
+  hit.dist = (tNear <= tFar && tFar > 0.0) ? dist : 0.0;
   hit.nodeIdx = box.nodeIdx;
-  hit.normal.origin = vec4(0.0);
-  hit.normal.dir = vec4(0.0);
-  vec3 tminVals = (box.minPoint.xyz - ray.origin.xyz) / ray.dir.xyz;
-  vec3 tmaxVals = (box.maxPoint.xyz - ray.origin.xyz) / ray.dir.xyz;
-  vec4 point;
-  point = rayAt(ray, tminVals.x);
-  if (box.minPoint.y <= point.y && point.y <= box.maxPoint.y &&
-      box.minPoint.z <= point.z && point.z <= box.maxPoint.z &&
-      (hit.dist == 0.0 || (0 < tminVals.x && tminVals.x < hit.dist))) {
-    hit.dist = tminVals.x;
-    hit.normal.dir = vec4(-1.0, 0.0, 0.0, 0.0);
-  }
-  point = rayAt(ray, tminVals.y);
-  if (box.minPoint.x <= point.x && point.x <= box.maxPoint.x &&
-      box.minPoint.z <= point.z && point.z <= box.maxPoint.z &&
-      (hit.dist == 0.0 || (0 < tminVals.y && tminVals.y < hit.dist))) {
-    hit.dist = tminVals.y;
-    hit.normal.dir = vec4(0.0, -1.0, 0.0, 0.0);
-  }
-  point = rayAt(ray, tminVals.z);
-  if (box.minPoint.x <= point.x && point.x <= box.maxPoint.x &&
-      box.minPoint.y <= point.y && point.y <= box.maxPoint.y &&
-      (hit.dist == 0.0 || (0 < tminVals.z && tminVals.z < hit.dist))) {
-    hit.dist = tminVals.z;
-    hit.normal.dir = vec4(0.0, 0.0, -1.0, 0.0);
-  }
-  point = rayAt(ray, tmaxVals.x);
-  if (box.minPoint.y <= point.y && point.y <= box.maxPoint.y &&
-      box.minPoint.z <= point.z && point.z <= box.maxPoint.z &&
-      (hit.dist == 0.0 || (0 < tmaxVals.x && tmaxVals.x < hit.dist))) {
-    hit.dist = tmaxVals.x;
-    hit.normal.dir = vec4(1.0, 0.0, 0.0, 0.0);
-  }
-  point = rayAt(ray, tmaxVals.y);
-  if (box.minPoint.x <= point.x && point.x <= box.maxPoint.x &&
-      box.minPoint.z <= point.z && point.z <= box.maxPoint.z &&
-      (hit.dist == 0.0 || (0 < tmaxVals.y && tmaxVals.y < hit.dist))) {
-    hit.dist = tmaxVals.y;
-    hit.normal.dir = vec4(0.0, 1.0, 0.0, 0.0);
-  }
-  point = rayAt(ray, tmaxVals.z);
-  if (box.minPoint.x <= point.x && point.x <= box.maxPoint.x &&
-      box.minPoint.y <= point.y && point.y <= box.maxPoint.y &&
-      (hit.dist == 0.0 || (0 < tmaxVals.z && tmaxVals.z < hit.dist))) {
-    hit.dist = tmaxVals.z;
-    hit.normal.dir = vec4(0.0, 0.0, 1.0, 0.0);
-  }
+  hit.normal.dir = vec4(face, 0.0);
   hit.normal.origin = rayAt(ray, hit.dist);
-
+  hit.normal.invDir = vec4(0.0);
   return hit;
 }
 
-RaycastHit octreeIntersect(Ray ray) {
-  Ray normal;
-
-  uint stack[STACK_SIZE] = uint[STACK_SIZE](0);
-  int stackIdx = 0;
-  stack[0] = 0;
-
-  RaycastHit bestHit;
-  bestHit.dist = 0.0;
-  bestHit.nodeIdx = 0;
-  bestHit.normal.origin = vec4(0.0);
-  bestHit.normal.dir = vec4(0.0);
-
-  while (stackIdx >= 0) {
-    uint nodeIdx = stack[stackIdx--];
-    Box box = getBox(nodeIdx);
-
+// Depth-first traversal that takes the children of every node front to
+// back. Along a ray with a positive direction the octant index only ever
+// gains bits, so increasing octant order mirrored along the ray's negative
+// axes is the order the ray enters the children in. Only one entry per
+// level is kept, so the stack cannot overflow.
+//
+// When carving, every leaf the ray passes through is counted, the inner
+// nodes are summed up from them by reduce.glsl. Otherwise the first node at
+// or above the threshold is the nearest and is returned. Frozen nodes are
+// neither counted nor descended into.
+RaycastHit octreeTraverse(Ray ray, bool carve, bool isBackground) {
+  uint dirMask = uint(ray.dir.x < 0.0) | uint(ray.dir.y < 0.0) << 1 |
+                 uint(ray.dir.z < 0.0) << 2;
+
+  uint childStack[MAX_DEPTH];
+  uvec4 posStack[MAX_DEPTH];
+  uint nextStack[MAX_DEPTH];
+  int level = -1;
+
+  uint nodeIdx = 0;
+  uvec4 pos = uvec4(0);
+  while (true) {
+    Box box = getBox(nodeIdx, pos);
     RaycastHit hit = boxIntersect(box, ray);
-    if (hit.dist > 0) {
-      float ratio =
-          float(octree.nodes[nodeIdx].hits) / octree.nodes[nodeIdx].total;
-      if (ratio >= threshold &&
-          (bestHit.dist == 0.0 || hit.dist < bestHit.dist)) {
-        bestHit = hit;
-      } else if (ratio < threshold &&
-                 octree.nodes[nodeIdx].depth != octree.depth) {
-        for (uint i = 0; i < 8; i++) {
-          stackIdx++;
-          if (stackIdx >= STACK_SIZE) {
-            fragColor = vec4(1.0, 0.0, 0.0, 1.0);
-            return bestHit;
-          }
-          stack[stackIdx] = box.childrenIdx[i];
+    if (hit.dist > 0.0) {
+      uint total = TOTAL(box.nodeIdx);
+      bool frozen = (total & FROZEN) != 0u;
+      if (carve) {
+        if (!frozen && box.leaf) {
+          atomicAdd(TOTAL(box.nodeIdx), 1);
+          if (isBackground)
+            atomicAdd(HITS(box.nodeIdx), 1);
         }
+      } else if (float(HITS(box.nodeIdx)) / float(total & ~FROZEN) >=
+                 threshold) {
+        return hit;
+      }
+      if (!frozen && !box.leaf && level < MAX_DEPTH - 1) {
+        ++level;
+        childStack[level] = box.children;
+        posStack[level] = pos;
+        nextStack[level] = 0;
       }
     }
+
+    while (level >= 0 && nextStack[level] == 8)
+      --level;
+    if (level < 0)
+      break;
+    uint octant = nextStack[level]++ ^ dirMask;
+    nodeIdx = childStack[level] + octant;
+    pos = childPos(posStack[level], octant);
   }
 
-  return bestHit;
+  RaycastHit noHit;
+  noHit.dist = 0.0;
+  noHit.nodeIdx = 0;
+  noHit.normal.origin = vec4(0.0);
+  noHit.normal.dir = vec4(0.0);
+  noHit.normal.invDir = vec4(0.0);
+  return noHit;
 }
 
 Ray getRay(vec2 screenCoord, mat4 invProj, mat4 invModelView) {
@@ -169,6 +175,7 @@ Ray getRay(vec2 screenCoord, mat4 invProj, mat4 invModelView) {
   ray.origin = invModelView * vec4(0.0, 0.0, 0.0, 1.0);
   ray.dir = invModelView * invProj * screenRay;
   ray.dir = normalize(ray.dir / ray.dir.w - ray.origin);
+  ray.invDir = 1.0 / ray.dir;
   return ray;
 }
 
@@ -177,38 +184,7 @@ vec4 mask() {
   vec4 pixel = texture(image, screenCoord);
   bool isBackground = (pixel.r + pixel.g + pixel.b) / 3.0 < 0.6;
   Ray ray = getRay(screenCoord, invProj, invModelView);
-
-  uint stack[STACK_SIZE] = uint[STACK_SIZE](0);
-  int stackIdx = 0;
-  stack[0] = 0;
-
-  RaycastHit bestHit;
-  bestHit.dist = 0.0;
-  bestHit.nodeIdx = 0;
-  bestHit.normal.origin = vec4(0.0);
-  bestHit.normal.dir = vec4(0.0);
-
-  while (stackIdx >= 0) {
-    uint nodeIdx = stack[stackIdx--];
-    Box box = getBox(nodeIdx);
-
-    RaycastHit hit = boxIntersect(box, ray);
-    if (hit.dist > 0) {
-      atomicAdd(octree.nodes[nodeIdx].total, 1);
-      if (isBackground)
-        atomicAdd(octree.nodes[nodeIdx].hits, 1);
-      if (octree.nodes[nodeIdx].depth != octree.depth) {
-        for (uint i = 0; i < 8; i++) {
-          stackIdx++;
-          if (stackIdx >= STACK_SIZE) {
-            fragColor = vec4(1.0, 0.0, 0.0, 1.0);
-            return fragColor;
-          }
-          stack[stackIdx] = box.childrenIdx[i];
-        }
-      }
-    }
-  }
+  octreeTraverse(ray, true, isBackground);
 
   if (isBackground)
     return pixel;
@@ -219,7 +195,7 @@ vec4 mask() {
 vec4 render() {
   vec2 screenCoord = gl_FragCoord.xy / screenSize;
   Ray ray = getRay(screenCoord, invProj, invModelView);
-  RaycastHit hit = octreeIntersect(ray);
+  RaycastHit hit = octreeTraverse(ray, false, false);
 
   if (hit.dist == 0.0)
     return texture(image, screenCoord);
@@ -231,8 +207,5 @@ vec4 render() {
 }
 
 void main() {
-  fragColor = vec4(0);
-  vec4 color = maskMode ? mask() : render();
-  if (fragColor == vec4(0))
-    fragColor = color;
+  fragColor = maskMode ? mask() : render();
 }
@@ -0,0 +1,15 @@
+#version 430
+
+uniform sampler2D image;
+uniform sampler2D undistortMap;
+uniform vec2 screenSize;
+
+out vec4 fragColor;
+
+void main() {
+  vec2 screenCoord = gl_FragCoord.xy / screenSize;
+  vec2 source = texture(undistortMap, screenCoord).xy;
+  bool inside = all(greaterThanEqual(source, vec2(0.0))) &&
+                all(lessThanEqual(source, vec2(1.0)));
+  fragColor = inside ? texture(image, source) : vec4(vec3(0.0), 1.0);
+}
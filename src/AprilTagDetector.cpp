@@ -1,8 +1,10 @@
 #include <model_scanner/AprilTagDetector.h>
+#include <model_scanner/Profiler.h>
+#include <apriltag/common/homography.h>
 
 namespace model_scanner {
 
-AprilTagDetector::AprilTagDetector(const Camera& camera) {
+AprilTagDetector::AprilTagDetector(const Camera& camera) : _tracking(false) {
   _td = apriltag_detector_create();
   _tf = tagStandard41h12_create();
 
@@ -19,6 +21,8 @@ AprilTagDetector::AprilTagDetector(const Camera& camera) {
   _info.fy = camera.calibration.k.at<double>(1, 1);
   _info.cx = camera.calibration.k.at<double>(0, 2);
   _info.cy = camera.calibration.k.at<double>(1, 2);
+  _k = camera.calibration.k;
+  _d = camera.calibration.d;
 }
 
 AprilTagDetector::~AprilTagDetector() {
@@ -33,19 +37,43 @@ void AprilTagDetector::addTagParams(TagParams params) {
 void AprilTagDetector::setFrame(const cv::Mat& frame) {
   cv::Mat grey;
   cv::cvtColor(frame, grey, cv::COLOR_BGR2GRAY);
+  setGreyFrame(grey);
+}
 
-  image_u8_t image = { .width = grey.cols,
-                       .height = grey.rows,
-                       .stride = grey.cols,
-                       .buf = grey.data };
+void AprilTagDetector::setGreyFrame(const cv::Mat& grey) {
+  detectTags(grey, false);
+}
+
+void AprilTagDetector::setRawGreyFrame(const cv::Mat& grey) {
+  detectTags(grey, true);
+}
+
+// The region predicted when tracking ignores the distortion of raw frames,
+// which its padding makes up for
+void AprilTagDetector::detectTags(const cv::Mat& grey, bool raw) {
+  PROFILE_SCOPE(DETECT);
+  cv::Rect full(0, 0, grey.cols, grey.rows);
+  zarray_t* detections = nullptr;
+  cv::Rect roi;
+  if (_tracking && predictRegion(full, roi) && roi.area() < full.area()) {
+    detections = detect(grey, roi);
+    if (!hasKnownTag(detections)) {
+      apriltag_detections_destroy(detections);
+      detections = nullptr;
+    }
+  }
+  if (detections == nullptr)
+    detections = detect(grey, full);
 
   _lastFrameTagPos.clear();
-  zarray_t* detections = apriltag_detector_detect(_td, &image);
+  _lastFrameMargin.clear();
   for (int i = 0; i < zarray_size(detections); ++i) {
     apriltag_detection_t* det;
     zarray_get(detections, i, &det);
 
     if (_tagSizes.contains(det->id)) {
+      if (raw)
+        undistortCorners(det);
       _info.det = det;
       _info.tagsize = _tagSizes[det->id];
       apriltag_pose_t pose;
@@ -73,6 +101,7 @@ void AprilTagDetector::setFrame(const cv::Mat& frame) {
       modelView[3][3] = 1.0;
 
       _lastFrameTagPos[det->id] = modelView;
+      _lastFrameMargin[det->id] = det->decision_margin;
     } else {
       std::cout << "Warning: No size known for tag " << det->id << std::endl;
     }
@@ -84,4 +113,120 @@ glm::mat4 AprilTagDetector::getPose(int id) {
   return _lastFrameTagPos[id];
 }
 
+float AprilTagDetector::getMargin(int id) {
+  return _lastFrameMargin[id];
+}
+
+void AprilTagDetector::setTracking(bool tracking) {
+  _tracking = tracking;
+}
+
+// Detections in roi come back in full frame coordinates
+zarray_t* AprilTagDetector::detect(const cv::Mat& grey, cv::Rect roi) {
+  image_u8_t image = { .width = roi.width,
+                       .height = roi.height,
+                       .stride = (int32_t) grey.step,
+                       .buf = grey.data + roi.y * grey.step + roi.x };
+  zarray_t* detections = apriltag_detector_detect(_td, &image);
+  if (roi.x == 0 && roi.y == 0)
+    return detections;
+
+  for (int i = 0; i < zarray_size(detections); ++i) {
+    apriltag_detection_t* det;
+    zarray_get(detections, i, &det);
+    det->c[0] += roi.x;
+    det->c[1] += roi.y;
+    for (int j = 0; j < 4; ++j) {
+      det->p[j][0] += roi.x;
+      det->p[j][1] += roi.y;
+    }
+    // Prepend the translation to the homography the pose is estimated from
+    double* h = det->H->data;
+    for (int col = 0; col < 3; ++col) {
+      h[col] += roi.x * h[6 + col];
+      h[3 + col] += roi.y * h[6 + col];
+    }
+  }
+  return detections;
+}
+
+// Moves the corners to where they are in the undistorted image and fits
+// the homography the pose is estimated from to them again, with the tag's
+// corners at (+-1, +-1) in the order the detector uses
+void AprilTagDetector::undistortCorners(apriltag_detection_t* det) const {
+  std::vector<cv::Point2f> corners;
+  for (int i = 0; i < 4; ++i)
+    corners.emplace_back(det->p[i][0], det->p[i][1]);
+  std::vector<cv::Point2f> undistorted;
+  cv::undistortPoints(corners, undistorted, _k, _d, cv::Mat(), _k);
+
+  double correspondences[4][4];
+  for (int i = 0; i < 4; ++i) {
+    det->p[i][0] = undistorted[i].x;
+    det->p[i][1] = undistorted[i].y;
+    correspondences[i][0] = (i == 1 || i == 2) ? 1.0 : -1.0;
+    correspondences[i][1] = i < 2 ? 1.0 : -1.0;
+    correspondences[i][2] = undistorted[i].x;
+    correspondences[i][3] = undistorted[i].y;
+  }
+  matd_destroy(det->H);
+  det->H = homography_compute2(correspondences);
+  homography_project(det->H, 0.0, 0.0, &det->c[0], &det->c[1]);
+}
+
+bool AprilTagDetector::hasKnownTag(zarray_t* detections) const {
+  for (int i = 0; i < zarray_size(detections); ++i) {
+    apriltag_detection_t* det;
+    zarray_get(detections, i, &det);
+    if (_tagSizes.contains(det->id))
+      return true;
+  }
+  return false;
+}
+
+// Projects the corners of every tag seen in the last frame and pads their
+// bounds for the motion since then
+bool AprilTagDetector::predictRegion(cv::Rect frame, cv::Rect& roi) const {
+  float minX = INFINITY;
+  float minY = INFINITY;
+  float maxX = -INFINITY;
+  float maxY = -INFINITY;
+  for (const auto& [id, modelView] : _lastFrameTagPos) {
+    auto tagSize = _tagSizes.find(id);
+    if (modelView == glm::mat4() || tagSize == _tagSizes.end())
+      continue;
+    float half = tagSize->second / 2.0;
+    for (int corner = 0; corner < 4; ++corner) {
+      glm::vec4 point = modelView * glm::vec4(corner & 1 ? half : -half,
+                                              corner & 2 ? half : -half,
+                                              0.0f, 1.0f);
+      // The pose looks down -z with y up, the image has y down
+      if (point.z >= 0.0f)
+        return false;
+      float x = _info.fx * point.x / -point.z + _info.cx;
+      float y = _info.fy * point.y / point.z + _info.cy;
+      minX = std::min(minX, x);
+      minY = std::min(minY, y);
+      maxX = std::max(maxX, x);
+      maxY = std::max(maxY, y);
+    }
+  }
+  if (minX > maxX)
+    return false;
+
+  float pad = ROI_PADDING * std::max(maxX - minX, maxY - minY) + ROI_MARGIN;
+  minX = std::clamp(minX - pad, 0.0f, (float) frame.width);
+  minY = std::clamp(minY - pad, 0.0f, (float) frame.height);
+  maxX = std::clamp(maxX + pad, 0.0f, (float) frame.width);
+  maxY = std::clamp(maxY + pad, 0.0f, (float) frame.height);
+
+  // Keep the origin even so quad_decimate samples the same pixels
+  int x0 = (int) minX & ~1;
+  int y0 = (int) minY & ~1;
+  roi = cv::Rect(x0, y0, (int) std::ceil(maxX) - x0,
+                 (int) std::ceil(maxY) - y0) &
+        frame;
+  return !roi.empty();
+}
+
 }  // namespace model_scanner
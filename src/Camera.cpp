@@ -1,4 +1,6 @@
 #include <model_scanner/Camera.h>
+#include <algorithm>
+#include <model_scanner/Profiler.h>
 
 namespace model_scanner {
 
@@ -6,7 +8,10 @@ Camera::Camera(const std::string& deviceName,
                const std::string& calibrationFile)
   : _deviceName(deviceName),
     _calibrationFile(calibrationFile),
-    _cap(deviceName) {
+    _cap(deviceName),
+    _ended(false),
+    _luma(false),
+    _lumaConversion(0) {
   calibration.k = cv::Mat::eye(3, 3, CV_64F);
   calibration.d = cv::Mat::zeros(1, 5, CV_64F);
   if (calibrationFile != "") {
@@ -20,22 +25,254 @@ Camera::Camera(const std::string& deviceName,
 
   width = _cap.get(cv::VideoCaptureProperties::CAP_PROP_FRAME_WIDTH);
   height = _cap.get(cv::VideoCaptureProperties::CAP_PROP_FRAME_HEIGHT);
+
+  // The same maps cv::undistort would build for every frame
+  cv::initUndistortRectifyMap(calibration.k, calibration.d, cv::Mat(),
+                              calibration.k, cv::Size(width, height), CV_32FC1,
+                              _mapX, _mapY);
+  _remap.resize(width * height);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      float srcX = _mapX.at<float>(y, x);
+      float srcY = _mapY.at<float>(y, x);
+      RemapEntry& entry = _remap[y * width + x];
+      if (!(0.0f <= srcX && srcX <= width - 1 && 0.0f <= srcY &&
+            srcY <= height - 1)) {
+        entry = { -1, -1, 0, 0 };
+        continue;
+      }
+      int x0 = srcX;
+      int y0 = srcY;
+      entry.x = x0;
+      entry.y = y0;
+      entry.wx = std::lround((srcX - x0) * 128);
+      entry.wy = std::lround((srcY - y0) * 128);
+    }
+  }
 }
 
 Camera::~Camera() {
   _cap.release();
 }
 
-cv::Mat Camera::getFrame() {
-  cv::Mat rawImage;
-  cv::Mat undistorted;
+bool Camera::read(cv::Mat& rawImage) {
+  PROFILE_SCOPE(CAPTURE);
   _cap >> rawImage;
-  if (rawImage.empty())
-    return _blankFrame;
-  if (_blankFrame.empty())
-    _blankFrame.create(rawImage.size(), rawImage.type());
-  cv::undistort(rawImage, undistorted, calibration.k, calibration.d);
-  return undistorted;
+  _ended = rawImage.empty();
+  Layout layout;
+  if (!_ended && _luma && !frameLayout(rawImage, layout)) {
+    std::cerr << "Error: Unable to work out the layout of frames of "
+              << _deviceName << std::endl;
+    _ended = true;
+  }
+  return !_ended;
+}
+
+bool Camera::ended() const {
+  return _ended;
+}
+
+const std::string& Camera::deviceName() const {
+  return _deviceName;
+}
+
+bool Camera::captureLuma() {
+  int fourcc = _cap.get(cv::VideoCaptureProperties::CAP_PROP_FOURCC);
+  auto is = [fourcc](const char* code) {
+    return fourcc == cv::VideoWriter::fourcc(code[0], code[1], code[2],
+                                             code[3]);
+  };
+  if (is("NV12")) {
+    _lumaConversion = cv::COLOR_YUV2BGR_NV12;
+  } else if (is("NV21")) {
+    _lumaConversion = cv::COLOR_YUV2BGR_NV21;
+  } else if (is("YU12") || is("I420")) {
+    _lumaConversion = cv::COLOR_YUV2BGR_I420;
+  } else if (is("YV12")) {
+    _lumaConversion = cv::COLOR_YUV2BGR_YV12;
+  } else if (is("YUYV") || is("YUY2")) {
+    _lumaConversion = cv::COLOR_YUV2BGR_YUYV;
+  } else if (is("GREY") || is("Y800")) {
+    _lumaConversion = cv::COLOR_GRAY2BGR;
+  } else {
+    std::cerr << "Warning: " << _deviceName << " does not deliver YUV "
+              << "frames, converting them to BGR" << std::endl;
+    return false;
+  }
+  if (!_cap.set(cv::VideoCaptureProperties::CAP_PROP_CONVERT_RGB, 0)) {
+    std::cerr << "Warning: Unable to read unconverted frames from "
+              << _deviceName << std::endl;
+    return false;
+  }
+  _luma = true;
+  return true;
+}
+
+bool Camera::capturesLuma() const {
+  return _luma;
+}
+
+cv::Mat Camera::luma(const cv::Mat& rawImage) const {
+  Layout layout;
+  if (!frameLayout(rawImage, layout))
+    return cv::Mat();
+  // Planar formats start with the Y plane
+  cv::Mat y = lumaPlane(rawImage, layout);
+  if (_lumaConversion != cv::COLOR_YUV2BGR_YUYV)
+    return y;
+  cv::Mat grey;
+  cv::extractChannel(y, grey, 0);
+  return grey;
+}
+
+void Camera::toBgr(const cv::Mat& rawImage, cv::Mat& bgr) const {
+  Layout layout;
+  if (!frameLayout(rawImage, layout))
+    return;
+  cv::Mat y = lumaPlane(rawImage, layout);
+  if (_lumaConversion == cv::COLOR_YUV2BGR_YUYV ||
+      _lumaConversion == cv::COLOR_GRAY2BGR) {
+    cv::cvtColor(y, bgr, _lumaConversion);
+    return;
+  }
+
+  cv::Mat lines = rawImage.reshape(1, rawImage.total() * rawImage.elemSize() /
+                                          layout.stride);
+  if (_lumaConversion == cv::COLOR_YUV2BGR_NV12 ||
+      _lumaConversion == cv::COLOR_YUV2BGR_NV21) {
+    cv::Mat uv = lines(cv::Rect(0, layout.lumaRows, width, height / 2));
+    cv::cvtColorTwoPlane(y, uv.reshape(2), bgr, _lumaConversion);
+    return;
+  }
+  if (layout.stride == (size_t) width && layout.lumaRows == height) {
+    cv::cvtColor(lines, bgr, _lumaConversion);
+    return;
+  }
+
+  // Padded I420 and YV12 planes are packed first, as each chroma row is
+  // half a stride and cvtColor expects them half a width apart
+  cv::Mat packed(height * 3 / 2, width, CV_8UC1);
+  y.copyTo(packed.rowRange(0, height));
+  size_t chromaStride = layout.stride / 2;
+  size_t chromaWidth = width / 2;
+  int chromaRows = height / 2;
+  for (int plane = 0; plane < 2; ++plane) {
+    const uint8_t* src = rawImage.data + layout.lumaRows * layout.stride +
+                         plane * chromaStride * (layout.lumaRows / 2);
+    uint8_t* dst = packed.ptr(height) + plane * chromaWidth * chromaRows;
+    for (int row = 0; row < chromaRows; ++row)
+      std::copy_n(src + row * chromaStride, chromaWidth,
+                  dst + row * chromaWidth);
+  }
+  cv::cvtColor(packed, bgr, _lumaConversion);
+}
+
+void Camera::undistort(const cv::Mat& rawImage, cv::Mat& rgb,
+                       cv::Mat& grey) const {
+  PROFILE_SCOPE(UNDISTORT);
+  rgb.create(height, width, CV_8UC3);
+  remap(rawImage, &rgb, &grey);
+}
+
+void Camera::undistortGrey(const cv::Mat& rawImage, cv::Mat& grey) const {
+  PROFILE_SCOPE(UNDISTORT);
+  remap(rawImage, nullptr, &grey);
+}
+
+void Camera::undistortRgb(const cv::Mat& rawImage, cv::Mat& rgb) const {
+  PROFILE_SCOPE(UNDISTORT);
+  rgb.create(height, width, CV_8UC3);
+  remap(rawImage, &rgb, nullptr);
+}
+
+const cv::Mat& Camera::undistortMapX() const {
+  return _mapX;
+}
+
+const cv::Mat& Camera::undistortMapY() const {
+  return _mapY;
+}
+
+// Pixels that map outside the raw image are black, like with cv::undistort
+void Camera::remap(const cv::Mat& rawImage, cv::Mat* rgb,
+                   cv::Mat* grey) const {
+  if (grey)
+    grey->create(height, width, CV_8UC1);
+  cv::parallel_for_(cv::Range(0, height), [&](const cv::Range& rows) {
+    for (int y = rows.start; y < rows.end; ++y) {
+      const RemapEntry* entry = &_remap[y * width];
+      uint8_t* rgbRow = rgb ? rgb->ptr<uint8_t>(height - 1 - y) : nullptr;
+      uint8_t* greyRow = grey ? grey->ptr<uint8_t>(y) : nullptr;
+      for (int x = 0; x < width; ++x, ++entry) {
+        uint32_t bgr[3] = { 0, 0, 0 };
+        if (entry->x >= 0) {
+          int x1 = std::min(entry->x + 1, width - 1);
+          int y1 = std::min(entry->y + 1, height - 1);
+          const uint8_t* p00 = rawImage.ptr<uint8_t>(entry->y) + 3 * entry->x;
+          const uint8_t* p01 = rawImage.ptr<uint8_t>(entry->y) + 3 * x1;
+          const uint8_t* p10 = rawImage.ptr<uint8_t>(y1) + 3 * entry->x;
+          const uint8_t* p11 = rawImage.ptr<uint8_t>(y1) + 3 * x1;
+          uint32_t wx = entry->wx;
+          uint32_t wy = entry->wy;
+          for (int c = 0; c < 3; ++c) {
+            uint32_t top = p00[c] * (128 - wx) + p01[c] * wx;
+            uint32_t bottom = p10[c] * (128 - wx) + p11[c] * wx;
+            bgr[c] = (top * (128 - wy) + bottom * wy + (1 << 13)) >> 14;
+          }
+        }
+        if (rgbRow) {
+          rgbRow[3 * x] = bgr[2];
+          rgbRow[3 * x + 1] = bgr[1];
+          rgbRow[3 * x + 2] = bgr[0];
+        }
+        if (greyRow)
+          greyRow[x] = (29 * bgr[0] + 150 * bgr[1] + 77 * bgr[2] + 128) >> 8;
+      }
+    }
+  });
+}
+
+// Decoders hand unconverted frames out as whatever Mat shape their backend
+// picks, often a single row, so only the bytes are looked at. Drivers may
+// pad rows to an aligned stride and the Y plane to an aligned height, e.g.
+// 1080 rows to 1088, without saying so, and the layout is the one of those
+// that fills the buffer exactly, preferring unpadded rows.
+bool Camera::frameLayout(const cv::Mat& rawImage, Layout& layout) const {
+  if (rawImage.empty() || !rawImage.isContinuous() ||
+      rawImage.depth() != CV_8U)
+    return false;
+  bool packed = _lumaConversion == cv::COLOR_YUV2BGR_YUYV ||
+                _lumaConversion == cv::COLOR_GRAY2BGR;
+  if (!packed && height % 2 != 0)
+    return false;
+  size_t bytes = rawImage.total() * rawImage.elemSize();
+  size_t rowBytes =
+      _lumaConversion == cv::COLOR_YUV2BGR_YUYV ? 2 * width : width;
+  for (bool paddedRows : { false, true }) {
+    for (int align : { 1, 16, 32, 64 }) {
+      int lumaRows = (height + align - 1) / align * align;
+      size_t lines = packed ? lumaRows : lumaRows * 3 / 2;
+      if (bytes % lines != 0)
+        continue;
+      size_t stride = bytes / lines;
+      if (paddedRows ? stride > rowBytes && stride % 16 == 0
+                     : stride == rowBytes) {
+        layout.stride = stride;
+        layout.lumaRows = lumaRows;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// The Y plane, or the whole YUYV frame, as a view with the frame's stride
+cv::Mat Camera::lumaPlane(const cv::Mat& rawImage,
+                          const Layout& layout) const {
+  int channels = _lumaConversion == cv::COLOR_YUV2BGR_YUYV ? 2 : 1;
+  cv::Mat lines = rawImage.reshape(1, rawImage.total() * rawImage.elemSize() /
+                                          layout.stride);
+  return lines(cv::Rect(0, 0, width * channels, height)).reshape(channels);
 }
 
 }  // namespace model_scanner
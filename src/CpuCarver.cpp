@@ -0,0 +1,161 @@
+#include <model_scanner/CpuCarver.h>
+
+namespace model_scanner {
+
+CpuCarver::CpuCarver(Octree& octree, size_t numThreads)
+  : _octree(octree), _pool(numThreads), _counters(_pool.size()) {}
+
+void CpuCarver::carve(const cv::Mat& frame, const glm::mat4& proj,
+                      const glm::mat4& modelView) {
+  carve({ { &frame, proj, modelView } });
+}
+
+// The tiles of all views go to the pool together and the counters are
+// reduced once for all of them
+void CpuCarver::carve(const std::vector<View>& views) {
+  for (auto& counters : _counters) {
+    counters.hits.resize(_octree._header.size, 0);
+    counters.total.resize(_octree._header.size, 0);
+  }
+
+  struct Tiles {
+    glm::mat4 invProj;
+    glm::mat4 invModelView;
+    int tilesX;
+    size_t first;
+  };
+  std::vector<Tiles> tiles;
+  size_t numTiles = 0;
+  for (const View& view : views) {
+    int tilesX = (view.frame->cols + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (view.frame->rows + TILE_SIZE - 1) / TILE_SIZE;
+    tiles.push_back({ glm::inverse(view.proj), glm::inverse(view.modelView),
+                      tilesX, numTiles });
+    numTiles += tilesX * tilesY;
+  }
+
+  _pool.parallelFor(numTiles, [&](size_t idx, size_t worker) {
+    size_t viewIdx = tiles.size() - 1;
+    while (idx < tiles[viewIdx].first)
+      --viewIdx;
+    const Tiles& viewTiles = tiles[viewIdx];
+    const cv::Mat& frame = *views[viewIdx].frame;
+    idx -= viewTiles.first;
+    cv::Rect tile((idx % viewTiles.tilesX) * TILE_SIZE,
+                  (idx / viewTiles.tilesX) * TILE_SIZE, TILE_SIZE, TILE_SIZE);
+    tile = tile & cv::Rect(0, 0, frame.cols, frame.rows);
+    carveTile(frame, viewTiles.invProj, viewTiles.invModelView, tile,
+              _counters[worker]);
+  });
+
+  reduce();
+}
+
+void CpuCarver::carveTile(const cv::Mat& frame, const glm::mat4& invProj,
+                          const glm::mat4& invModelView, cv::Rect tile,
+                          Counters& counters) {
+  Octree::Box root = _octree.rootBox();
+  glm::vec2 screenSize(frame.cols, frame.rows);
+  for (int y = tile.y; y < tile.y + tile.height; ++y) {
+    const uint8_t* row = frame.ptr<uint8_t>(y);
+    for (int x = tile.x; x < tile.x + tile.width; ++x) {
+      glm::vec2 screenCoord(x + 0.5f, y + 0.5f);
+      Ray ray = getRay(screenCoord / screenSize, invProj, invModelView);
+
+      // render2 only rasterizes the quad covering the bottom face of the
+      // root box, so only rays that cross it carve
+      float t = (root.minPoint.z - ray.origin.z) * ray.invDir.z;
+      glm::vec3 point = ray.origin + t * ray.dir;
+      if (!(t > 0 && root.minPoint.x <= point.x &&
+            point.x <= root.maxPoint.x && root.minPoint.y <= point.y &&
+            point.y <= root.maxPoint.y))
+        continue;
+
+      const uint8_t* pixel = row + 3 * x;
+      bool isBackground = (pixel[0] + pixel[1] + pixel[2]) / 3.0 < 0.6 * 255;
+      castRay(ray, isBackground, counters);
+    }
+  }
+}
+
+void CpuCarver::castRay(const Ray& ray, bool isBackground,
+                        Counters& counters) {
+  struct Entry {
+    uint32_t idx;
+    int depth;
+    Octree::Box box;
+  };
+
+  Octree::Box root = _octree.rootBox();
+  float tNear;
+  if (!intersectBox(ray.origin, ray.invDir, root.minPoint, root.maxPoint,
+                    tNear) ||
+      _octree.isFrozen(0))
+    return;
+  ++counters.total[0];
+  if (isBackground)
+    ++counters.hits[0];
+
+  Entry stack[8 * 32];
+  int stackIdx = 0;
+  stack[0] = { 0, 0, root };
+
+  while (stackIdx >= 0) {
+    Entry entry = stack[stackIdx--];
+    size_t children = _octree.firstChild(entry.idx, entry.depth);
+    if (children == 0)
+      continue;
+
+    float childNear[8];
+    ChildBounds bounds =
+        ChildBounds::split(entry.box.minPoint, entry.box.maxPoint);
+    uint32_t mask = intersectChildren(ray.origin, ray.invDir, bounds,
+                                      childNear);
+    while (mask != 0) {
+      size_t octant = __builtin_ctz(mask);
+      size_t childIdx = children + octant;
+      mask &= mask - 1;
+      if (_octree.isFrozen(childIdx))
+        continue;
+      ++counters.total[childIdx];
+      if (isBackground)
+        ++counters.hits[childIdx];
+      stack[++stackIdx] = { (uint32_t) childIdx, entry.depth + 1,
+                            entry.box.child(octant) };
+    }
+  }
+}
+
+void CpuCarver::reduce() {
+  size_t size = _octree._header.size;
+  size_t numChunks = (size + REDUCE_CHUNK - 1) / REDUCE_CHUNK;
+  _pool.parallelFor(numChunks, [&](size_t chunk, size_t) {
+    size_t end = std::min(size, (chunk + 1) * REDUCE_CHUNK);
+    for (size_t i = chunk * REDUCE_CHUNK; i < end; ++i) {
+      for (auto& counters : _counters) {
+        _octree._hits[i] += counters.hits[i];
+        _octree._total[i] += counters.total[i];
+        counters.hits[i] = 0;
+        counters.total[i] = 0;
+      }
+    }
+  });
+}
+
+CpuCarver::Ray CpuCarver::getRay(glm::vec2 screenCoord,
+                                 const glm::mat4& invProj,
+                                 const glm::mat4& invModelView) {
+  glm::vec4 screenRay(2.0f * screenCoord.x - 1.0f,
+                      2.0f * screenCoord.y - 1.0f, -1.0f, 1.0f);
+  glm::vec4 origin = invModelView * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+  glm::vec4 dir = invModelView * invProj * screenRay;
+  dir = dir / dir.w - origin;
+
+  Ray ray;
+  ray.origin = glm::vec3(origin);
+  ray.dir = glm::normalize(glm::vec3(dir));
+  ray.invDir = 1.0f / ray.dir;
+  return ray;
+}
+
+}  // namespace model_scanner
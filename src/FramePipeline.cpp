@@ -0,0 +1,172 @@
+#include <model_scanner/FramePipeline.h>
+
+namespace model_scanner {
+
+FramePipeline::FramePipeline(Camera& camera, AprilTagDetector& detector,
+                             Policy policy, bool gpuUndistort,
+                             uint8_t* uploadStorage, size_t slotSize,
+                             size_t queueSize)
+  : _camera(camera),
+    _detector(detector),
+    _policy(policy),
+    _gpuUndistort(gpuUndistort),
+    _luma(camera.capturesLuma()),
+    _copyUpload(gpuUndistort && uploadStorage != nullptr && !_luma),
+    _ring(ringSize(queueSize)),
+    _free(_ring.size()),
+    _decoded(queueSize),
+    _undistorted(queueSize),
+    _detected(queueSize),
+    _decodeDone(false),
+    _undistortDone(false),
+    _detectDone(false),
+    _stop(false),
+    _current(nullptr) {
+  if (_policy == AUTO)
+    _policy = isDevice(camera.deviceName()) ? DROP_OLDEST : BLOCK;
+
+  for (size_t i = 0; i < _ring.size(); ++i) {
+    Frame& frame = _ring[i];
+    frame.index = i;
+    frame.raw.create(camera.height, camera.width, CV_8UC3);
+    frame.grey.create(camera.height, camera.width, CV_8UC1);
+    if (uploadStorage)
+      frame.upload = cv::Mat(camera.height, camera.width, CV_8UC3,
+                             uploadStorage + i * slotSize);
+    else if (_gpuUndistort && !_luma)
+      frame.upload = frame.raw;
+    else
+      frame.upload.create(camera.height, camera.width, CV_8UC3);
+    if (!_gpuUndistort)
+      frame.rgb = frame.upload;
+    _free.tryPush(&frame);
+  }
+
+  _threads.emplace_back(&FramePipeline::decodeLoop, this);
+  _threads.emplace_back(&FramePipeline::undistortLoop, this);
+  _threads.emplace_back(&FramePipeline::detectLoop, this);
+}
+
+FramePipeline::~FramePipeline() {
+  _stop = true;
+  for (Queue* queue : {&_free, &_decoded, &_undistorted, &_detected})
+    queue->wake();
+  for (auto& thread : _threads)
+    thread.join();
+}
+
+const FramePipeline::Frame* FramePipeline::next() {
+  Frame* frame;
+  if (!pop(_detected, _detectDone, frame))
+    return nullptr;
+  if (_current)
+    recycle(_current);
+  _current = frame;
+  return frame;
+}
+
+void FramePipeline::decodeLoop() {
+  Frame* frame;
+  while (!_stop) {
+    uint32_t pushes = _free.pushes();
+    if (!_free.tryPop(frame)) {
+      _free.waitForPush(pushes);
+      continue;
+    }
+    if (!_camera.read(frame->raw)) {
+      recycle(frame);
+      break;
+    }
+    push(_decoded, frame);
+  }
+  _decodeDone = true;
+  _decoded.wake();
+}
+
+void FramePipeline::undistortLoop() {
+  Frame* frame;
+  while (pop(_decoded, _decodeDone, frame)) {
+    if (_luma) {
+      // Tags are found in the Y plane, colour is only needed for the texture
+      frame->grey = _camera.luma(frame->raw);
+      if (_gpuUndistort) {
+        _camera.toBgr(frame->raw, frame->upload);
+      } else {
+        _camera.toBgr(frame->raw, frame->bgr);
+        _camera.undistortRgb(frame->bgr, frame->rgb);
+      }
+    } else if (_gpuUndistort) {
+      _camera.undistortGrey(frame->raw, frame->grey);
+    } else {
+      _camera.undistort(frame->raw, frame->rgb, frame->grey);
+    }
+    if (_copyUpload)
+      frame->raw.copyTo(frame->upload);
+    push(_undistorted, frame);
+  }
+  _undistortDone = true;
+  _undistorted.wake();
+}
+
+void FramePipeline::detectLoop() {
+  Frame* frame;
+  while (pop(_undistorted, _undistortDone, frame)) {
+    if (_luma)
+      _detector.setRawGreyFrame(frame->grey);
+    else
+      _detector.setGreyFrame(frame->grey);
+    frame->pose = _detector.getPose(0);
+    frame->margin = _detector.getMargin(0);
+    push(_detected, frame);
+  }
+  _detectDone = true;
+  _detected.wake();
+}
+
+// Waits for a frame until the stage feeding queue is done and has nothing
+// left in it
+bool FramePipeline::pop(Queue& queue, const std::atomic<bool>& done,
+                        Frame*& frame) {
+  while (!_stop) {
+    uint32_t pushes = queue.pushes();
+    if (queue.tryPop(frame))
+      return true;
+    if (done)
+      return queue.tryPop(frame);
+    queue.waitForPush(pushes);
+  }
+  return false;
+}
+
+void FramePipeline::push(Queue& queue, Frame* frame) {
+  while (true) {
+    uint32_t pops = queue.pops();
+    if (queue.tryPush(frame))
+      return;
+    Frame* oldest;
+    if (_stop) {
+      recycle(frame);
+      return;
+    } else if (_policy == DROP_OLDEST && queue.tryPop(oldest)) {
+      recycle(oldest);
+    } else {
+      queue.waitForPop(pops);
+    }
+  }
+}
+
+void FramePipeline::recycle(Frame* frame) {
+  _free.tryPush(frame);
+}
+
+// Every stage holds at most one frame besides the ones queued up, so the
+// ring never runs dry for good
+size_t FramePipeline::ringSize(size_t queueSize) {
+  return 3 * queueSize + 4;
+}
+
+bool FramePipeline::isDevice(const std::string& deviceName) {
+  return deviceName.rfind("/dev/", 0) == 0;
+}
+
+}  // namespace model_scanner
@@ -0,0 +1,145 @@
+#include <model_scanner/Headless.h>
+#include <model_scanner/Profiler.h>
+#include <EGL/eglext.h>
+#include <chrono>
+
+namespace model_scanner {
+
+Headless::Headless(const Scanner::Options& options)
+  : _display(EGL_NO_DISPLAY),
+    _context(EGL_NO_CONTEXT),
+    _valid(false),
+    _useGL(!options.cpuCarving && !options.voxelCarving),
+    _traceFile(options.traceFile),
+    _scanner(options) {
+  // The CPU carver does not need a GL context at all
+  if (!_useGL) {
+    _valid = true;
+    return;
+  }
+
+  if (!createContext())
+    return;
+
+  GLenum err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+  // GLX builds of GLEW still load the core entry points before failing here
+  if (err == GLEW_ERROR_NO_GLX_DISPLAY)
+    err = GLEW_OK;
+#endif
+  if (err != GLEW_OK) {
+    std::cerr << "Error: " << glewGetErrorString(err) << std::endl;
+    return;
+  }
+
+  _valid = _scanner.initGL();
+}
+
+Headless::~Headless() {
+  if (_display == EGL_NO_DISPLAY)
+    return;
+  if (_context != EGL_NO_CONTEXT)
+    _scanner.releaseGL();
+  eglMakeCurrent(_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  if (_context != EGL_NO_CONTEXT)
+    eglDestroyContext(_display, _context);
+  eglTerminate(_display);
+}
+
+int Headless::run() {
+  if (!_valid) {
+    std::cerr << "Error: No usable offscreen GL context" << std::endl;
+    return 1;
+  }
+
+  const Camera& camera = _scanner.camera();
+  if (_useGL)
+    glViewport(0, 0, camera.width, camera.height);
+
+  if (!_traceFile.empty())
+    Profiler::instance().startTrace();
+  size_t frames = 0;
+  auto start = std::chrono::steady_clock::now();
+  while (_scanner.render0()) {
+    _scanner.render2();
+    ++frames;
+    PROFILE_FRAME();
+  }
+  if (_useGL)
+    glFinish();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  std::cout << "Carved " << frames << " frames in " << elapsed.count()
+            << " s (" << frames / elapsed.count() << " frames/sec)"
+            << std::endl;
+  if (_scanner.keyframes().enabled())
+    std::cout << "Selected " << _scanner.keyframes().selected()
+              << " keyframes from " << _scanner.keyframes().size()
+              << " viewpoints" << std::endl;
+
+  if (!_traceFile.empty() && Profiler::instance().stopTrace(_traceFile))
+    std::cout << "Wrote trace to " << _traceFile << std::endl;
+  _scanner.writeModel();
+  return 0;
+}
+
+bool Headless::createContext() {
+  auto getPlatformDisplay =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress(
+          "eglGetPlatformDisplayEXT");
+  if (getPlatformDisplay != nullptr)
+    _display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                                  EGL_DEFAULT_DISPLAY, nullptr);
+  if (_display == EGL_NO_DISPLAY)
+    _display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+  EGLint major, minor;
+  if (_display == EGL_NO_DISPLAY ||
+      !eglInitialize(_display, &major, &minor)) {
+    std::cerr << "Error: Unable to initialize EGL display" << std::endl;
+    _display = EGL_NO_DISPLAY;
+    return false;
+  }
+
+  const EGLint configAttribs[] = { EGL_SURFACE_TYPE,
+                                   EGL_PBUFFER_BIT,
+                                   EGL_RENDERABLE_TYPE,
+                                   EGL_OPENGL_BIT,
+                                   EGL_NONE };
+  EGLConfig config;
+  EGLint numConfigs = 0;
+  if (!eglChooseConfig(_display, configAttribs, &config, 1, &numConfigs) ||
+      numConfigs == 0) {
+    std::cerr << "Error: No EGL config supports desktop OpenGL" << std::endl;
+    return false;
+  }
+
+  // The carving passes still use the fixed-function matrix stack
+  eglBindAPI(EGL_OPENGL_API);
+  const EGLint contextAttribs[] = {
+    EGL_CONTEXT_MAJOR_VERSION,
+    4,
+    EGL_CONTEXT_MINOR_VERSION,
+    3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK,
+    EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+    EGL_NONE
+  };
+  _context = eglCreateContext(_display, config, EGL_NO_CONTEXT,
+                              contextAttribs);
+  if (_context == EGL_NO_CONTEXT) {
+    std::cerr << "Error: Unable to create a GL 4.3 compatibility context"
+              << std::endl;
+    return false;
+  }
+
+  if (!eglMakeCurrent(_display, EGL_NO_SURFACE, EGL_NO_SURFACE, _context)) {
+    std::cerr << "Error: EGL_KHR_surfaceless_context is not supported"
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace model_scanner
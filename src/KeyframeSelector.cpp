@@ -0,0 +1,86 @@
+#include <model_scanner/KeyframeSelector.h>
+#include <cmath>
+
+namespace model_scanner {
+
+KeyframeSelector::KeyframeSelector(float angle, float distance, float gain)
+  : _cosAngle(std::cos(angle * M_PI / 180.0)),
+    _maxLogDistance(std::log1p(distance)),
+    _gain(gain),
+    _enabled(angle > 0.0),
+    _selected(0) {}
+
+bool KeyframeSelector::enabled() const {
+  return _enabled;
+}
+
+bool KeyframeSelector::select(const glm::mat4& pose, const cv::Mat& grey,
+                              float margin) {
+  if (!_enabled)
+    return true;
+
+  // Where the camera is, seen from the tag
+  glm::vec3 position(glm::inverse(pose)[3]);
+  float distance = glm::length(position);
+  glm::vec3 direction = position / distance;
+
+  Keyframe* nearest = nullptr;
+  float nearestCos = _cosAngle;
+  for (Keyframe& keyframe : _keyframes) {
+    float cos = glm::dot(direction, keyframe.direction);
+    if (cos >= nearestCos &&
+        std::abs(std::log(distance / keyframe.distance)) <= _maxLogDistance) {
+      nearest = &keyframe;
+      nearestCos = cos;
+    }
+  }
+
+  float quality = sharpness(grey) * margin;
+  if (nearest == nullptr) {
+    _keyframes.push_back({ direction, distance, quality });
+    ++_selected;
+    return true;
+  }
+  if (quality <= nearest->quality * (1.0 + _gain))
+    return false;
+  *nearest = { direction, distance, quality };
+  ++_selected;
+  return true;
+}
+
+void KeyframeSelector::clear() {
+  _keyframes.clear();
+  _selected = 0;
+}
+
+size_t KeyframeSelector::size() const {
+  return _keyframes.size();
+}
+
+size_t KeyframeSelector::selected() const {
+  return _selected;
+}
+
+float KeyframeSelector::sharpness(const cv::Mat& grey) {
+  double sum = 0.0;
+  double sumSq = 0.0;
+  size_t count = 0;
+  for (int y = 1; y < grey.rows - 1; y += SHARPNESS_STEP) {
+    const uint8_t* above = grey.ptr<uint8_t>(y - 1);
+    const uint8_t* row = grey.ptr<uint8_t>(y);
+    const uint8_t* below = grey.ptr<uint8_t>(y + 1);
+    for (int x = 1; x < grey.cols - 1; x += SHARPNESS_STEP) {
+      int laplacian = 4 * row[x] - row[x - 1] - row[x + 1] - above[x] -
+                      below[x];
+      sum += laplacian;
+      sumSq += laplacian * laplacian;
+      ++count;
+    }
+  }
+  if (count == 0)
+    return 0.0;
+  double mean = sum / count;
+  return sumSq / count - mean * mean;
+}
+
+}  // namespace model_scanner
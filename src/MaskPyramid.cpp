@@ -0,0 +1,92 @@
+#include <model_scanner/MaskPyramid.h>
+
+namespace model_scanner {
+
+void MaskPyramid::build(const cv::Mat& frame) {
+  _min.resize(1);
+  _max.resize(1);
+  _min[0].create(frame.rows, frame.cols, CV_8U);
+  for (int y = 0; y < frame.rows; ++y) {
+    const uint8_t* pixel = frame.ptr<uint8_t>(y);
+    uint8_t* mask = _min[0].ptr<uint8_t>(y);
+    for (int x = 0; x < frame.cols; ++x, pixel += 3)
+      mask[x] = (pixel[0] + pixel[1] + pixel[2]) / 3.0 < 0.6 * 255;
+  }
+  _max[0] = _min[0];
+
+  for (size_t level = 1; _min.back().cols > 1 || _min.back().rows > 1;
+       ++level) {
+    const cv::Mat& prevMin = _min[level - 1];
+    const cv::Mat& prevMax = _max[level - 1];
+    int cols = (prevMin.cols + 1) / 2;
+    int rows = (prevMin.rows + 1) / 2;
+    cv::Mat levelMin(rows, cols, CV_8U);
+    cv::Mat levelMax(rows, cols, CV_8U);
+    for (int y = 0; y < rows; ++y) {
+      int y1 = std::min(2 * y + 1, prevMin.rows - 1);
+      const uint8_t* min0 = prevMin.ptr<uint8_t>(2 * y);
+      const uint8_t* min1 = prevMin.ptr<uint8_t>(y1);
+      const uint8_t* max0 = prevMax.ptr<uint8_t>(2 * y);
+      const uint8_t* max1 = prevMax.ptr<uint8_t>(y1);
+      uint8_t* outMin = levelMin.ptr<uint8_t>(y);
+      uint8_t* outMax = levelMax.ptr<uint8_t>(y);
+      for (int x = 0; x < cols; ++x) {
+        int x0 = 2 * x;
+        int x1 = std::min(2 * x + 1, prevMin.cols - 1);
+        outMin[x] = min0[x0] & min0[x1] & min1[x0] & min1[x1];
+        outMax[x] = max0[x0] | max0[x1] | max1[x0] | max1[x1];
+      }
+    }
+    _min.push_back(levelMin);
+    _max.push_back(levelMax);
+  }
+}
+
+MaskPyramid::Coverage MaskPyramid::coverage(cv::Rect rect) const {
+  int extent = std::max(rect.width, rect.height);
+  int level = 0;
+  while ((2 << level) < extent)
+    ++level;
+  level = std::min(level, (int) _min.size() - 1);
+
+  int x0 = rect.x >> level;
+  int y0 = rect.y >> level;
+  int x1 = (rect.x + rect.width - 1) >> level;
+  int y1 = (rect.y + rect.height - 1) >> level;
+  uint8_t min = 1;
+  uint8_t max = 0;
+  for (int y = y0; y <= y1; ++y) {
+    const uint8_t* rowMin = _min[level].ptr<uint8_t>(y);
+    const uint8_t* rowMax = _max[level].ptr<uint8_t>(y);
+    for (int x = x0; x <= x1; ++x) {
+      min &= rowMin[x];
+      max |= rowMax[x];
+    }
+  }
+
+  if (max == 0)
+    return OUTSIDE;
+  if (min == 1)
+    return INSIDE;
+  return MIXED;
+}
+
+uint32_t MaskPyramid::count(cv::Rect rect) const {
+  uint32_t count = 0;
+  for (int y = rect.y; y < rect.y + rect.height; ++y) {
+    const uint8_t* row = _min[0].ptr<uint8_t>(y);
+    for (int x = rect.x; x < rect.x + rect.width; ++x)
+      count += row[x];
+  }
+  return count;
+}
+
+int MaskPyramid::cols() const {
+  return _min.empty() ? 0 : _min[0].cols;
+}
+
+int MaskPyramid::rows() const {
+  return _min.empty() ? 0 : _min[0].rows;
+}
+
+}  // namespace model_scanner
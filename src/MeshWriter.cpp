@@ -0,0 +1,265 @@
+#include <model_scanner/MeshWriter.h>
+#include <glm/geometric.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace model_scanner {
+
+namespace {
+
+// Every quad is split into these two triangles
+constexpr size_t TRIANGLES[2][3] = { { 0, 1, 2 }, { 0, 2, 3 } };
+
+char* writeFloats(char* out, const glm::vec3& v) {
+  float f[3] = { v.x, v.y, v.z };
+  std::memcpy(out, f, sizeof(f));
+  return out + sizeof(f);
+}
+
+// Corners are at most 2^15 cells along each axis
+uint64_t cornerKey(const glm::ivec3& corner) {
+  return (uint64_t) corner.x << 42 | (uint64_t) corner.y << 21 |
+         (uint64_t) corner.z;
+}
+
+}  // namespace
+
+MeshWriter::MeshWriter(ThreadPool& pool, glm::vec3 origin, glm::vec3 cellSize)
+  : _pool(pool), _origin(origin), _cellSize(cellSize) {}
+
+bool MeshWriter::write(const std::string& filename,
+                       const std::vector<Quad>& quads) {
+  Format format = formatFor(filename);
+  if (format == STL)
+    return writeStl(filename, quads);
+  std::vector<glm::vec3> vertices;
+  std::vector<uint32_t> triangles;
+  indexCorners(quads, vertices, triangles);
+  if (format == PLY)
+    return writePly(filename, vertices, triangles);
+  return writeObj(filename, vertices, triangles);
+}
+
+bool MeshWriter::write(const std::string& filename,
+                       const std::vector<glm::vec3>& vertices,
+                       const std::vector<uint32_t>& triangles) {
+  switch (formatFor(filename)) {
+    case PLY:
+      return writePly(filename, vertices, triangles);
+    case OBJ:
+      return writeObj(filename, vertices, triangles);
+    default:
+      return writeStl(filename, vertices, triangles);
+  }
+}
+
+MeshWriter::Format MeshWriter::formatFor(const std::string& filename) {
+  size_t dot = filename.rfind('.');
+  std::string extension = dot == std::string::npos ? "" : filename.substr(dot);
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 ::tolower);
+  if (extension == ".ply")
+    return PLY;
+  if (extension == ".obj")
+    return OBJ;
+  return STL;
+}
+
+bool MeshWriter::writeStl(const std::string& filename,
+                          const std::vector<Quad>& quads) {
+  uint32_t numTris = 2 * quads.size();
+  std::vector<char> buffer(STL_HEADER_SIZE + STL_TRIANGLE_SIZE * numTris, 0);
+  std::memcpy(&buffer[STL_HEADER_SIZE - sizeof(uint32_t)], &numTris,
+              sizeof(uint32_t));
+
+  size_t numChunks = (quads.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  _pool.parallelFor(numChunks, [&](size_t chunk, size_t) {
+    size_t begin = chunk * CHUNK_SIZE;
+    size_t end = std::min(quads.size(), begin + CHUNK_SIZE);
+    char* out = &buffer[STL_HEADER_SIZE + 2 * STL_TRIANGLE_SIZE * begin];
+    for (size_t i = begin; i < end; ++i) {
+      const Quad& quad = quads[i];
+      glm::vec3 normal(quad.normal.x, quad.normal.y, quad.normal.z);
+      for (auto& tri : TRIANGLES) {
+        out = writeFloats(out, normal);
+        for (size_t corner : tri)
+          out = writeFloats(out, position(quad.corners[corner]));
+        // Attribute byte count, already zero
+        out += sizeof(uint16_t);
+      }
+    }
+  });
+
+  std::ofstream outFile(filename, std::ios::binary);
+  if (!outFile.write(buffer.data(), buffer.size())) {
+    std::cerr << "Error: Could not write " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool MeshWriter::writeStl(const std::string& filename,
+                          const std::vector<glm::vec3>& vertices,
+                          const std::vector<uint32_t>& triangles) {
+  uint32_t numTris = triangles.size() / 3;
+  std::vector<char> buffer(STL_HEADER_SIZE + STL_TRIANGLE_SIZE * numTris, 0);
+  std::memcpy(&buffer[STL_HEADER_SIZE - sizeof(uint32_t)], &numTris,
+              sizeof(uint32_t));
+
+  size_t numChunks = (numTris + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  _pool.parallelFor(numChunks, [&](size_t chunk, size_t) {
+    size_t begin = chunk * CHUNK_SIZE;
+    size_t end = std::min<size_t>(numTris, begin + CHUNK_SIZE);
+    char* out = &buffer[STL_HEADER_SIZE + STL_TRIANGLE_SIZE * begin];
+    for (size_t i = begin; i < end; ++i) {
+      const glm::vec3& a = vertices[triangles[3 * i]];
+      const glm::vec3& b = vertices[triangles[3 * i + 1]];
+      const glm::vec3& c = vertices[triangles[3 * i + 2]];
+      glm::vec3 normal = glm::cross(b - a, c - a);
+      float length = glm::length(normal);
+      out = writeFloats(out, length > 0.0f ? normal / length : normal);
+      out = writeFloats(out, a);
+      out = writeFloats(out, b);
+      out = writeFloats(out, c);
+      // Attribute byte count, already zero
+      out += sizeof(uint16_t);
+    }
+  });
+
+  std::ofstream outFile(filename, std::ios::binary);
+  if (!outFile.write(buffer.data(), buffer.size())) {
+    std::cerr << "Error: Could not write " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool MeshWriter::writePly(const std::string& filename,
+                          const std::vector<glm::vec3>& vertices,
+                          const std::vector<uint32_t>& triangles) {
+  size_t numTris = triangles.size() / 3;
+  std::ofstream outFile(filename, std::ios::binary);
+  outFile << "ply\n"
+          << "format binary_little_endian 1.0\n"
+          << "element vertex " << vertices.size() << "\n"
+          << "property float x\n"
+          << "property float y\n"
+          << "property float z\n"
+          << "element face " << numTris << "\n"
+          << "property list uchar uint vertex_indices\n"
+          << "end_header\n";
+
+  std::vector<char> buffer(3 * sizeof(float) * vertices.size());
+  for (size_t i = 0; i < vertices.size(); ++i)
+    writeFloats(&buffer[3 * sizeof(float) * i], vertices[i]);
+  outFile.write(buffer.data(), buffer.size());
+
+  constexpr size_t FACE_SIZE = 1 + 3 * sizeof(uint32_t);
+  buffer.assign(FACE_SIZE * numTris, 0);
+  size_t numChunks = (numTris + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  _pool.parallelFor(numChunks, [&](size_t chunk, size_t) {
+    size_t begin = chunk * CHUNK_SIZE;
+    size_t end = std::min(numTris, begin + CHUNK_SIZE);
+    char* out = &buffer[FACE_SIZE * begin];
+    for (size_t i = begin; i < end; ++i) {
+      *out++ = 3;
+      std::memcpy(out, &triangles[3 * i], 3 * sizeof(uint32_t));
+      out += 3 * sizeof(uint32_t);
+    }
+  });
+  if (!outFile.write(buffer.data(), buffer.size())) {
+    std::cerr << "Error: Could not write " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool MeshWriter::writeObj(const std::string& filename,
+                          const std::vector<glm::vec3>& vertices,
+                          const std::vector<uint32_t>& triangles) {
+  size_t numTris = triangles.size() / 3;
+
+  // Chunks are formatted in parallel and written in order
+  size_t numVertexChunks = (vertices.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  size_t numTriChunks = (numTris + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  std::vector<std::string> chunks(numVertexChunks + numTriChunks);
+  _pool.parallelFor(chunks.size(), [&](size_t chunk, size_t) {
+    std::string& out = chunks[chunk];
+    char line[64];
+    if (chunk < numVertexChunks) {
+      size_t begin = chunk * CHUNK_SIZE;
+      size_t end = std::min(vertices.size(), begin + CHUNK_SIZE);
+      for (size_t i = begin; i < end; ++i) {
+        const glm::vec3& v = vertices[i];
+        out.append(line, std::snprintf(line, sizeof(line), "v %g %g %g\n",
+                                       v.x, v.y, v.z));
+      }
+    } else {
+      size_t begin = (chunk - numVertexChunks) * CHUNK_SIZE;
+      size_t end = std::min(numTris, begin + CHUNK_SIZE);
+      for (size_t i = begin; i < end; ++i) {
+        // OBJ indices start at 1
+        const uint32_t* idx = &triangles[3 * i];
+        out.append(line, std::snprintf(line, sizeof(line), "f %u %u %u\n",
+                                       idx[0] + 1, idx[1] + 1, idx[2] + 1));
+      }
+    }
+  });
+
+  std::ofstream outFile(filename, std::ios::binary);
+  for (const std::string& chunk : chunks)
+    outFile.write(chunk.data(), chunk.size());
+  if (!outFile) {
+    std::cerr << "Error: Could not write " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Gives every distinct corner one vertex, in sorted order, and splits every
+// quad into two triangles of those
+void MeshWriter::indexCorners(const std::vector<Quad>& quads,
+                              std::vector<glm::vec3>& vertices,
+                              std::vector<uint32_t>& triangles) {
+  std::vector<uint64_t> keys(4 * quads.size());
+  for (size_t i = 0; i < quads.size(); ++i)
+    for (size_t j = 0; j < 4; ++j)
+      keys[4 * i + j] = cornerKey(quads[i].corners[j]);
+  std::vector<uint64_t> unique = keys;
+  std::sort(unique.begin(), unique.end());
+  unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+
+  triangles.resize(6 * quads.size());
+  size_t numChunks = (quads.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  _pool.parallelFor(numChunks, [&](size_t chunk, size_t) {
+    size_t begin = chunk * CHUNK_SIZE;
+    size_t end = std::min(quads.size(), begin + CHUNK_SIZE);
+    for (size_t i = begin; i < end; ++i) {
+      uint32_t corners[4];
+      for (size_t j = 0; j < 4; ++j)
+        corners[j] = std::lower_bound(unique.begin(), unique.end(),
+                                      keys[4 * i + j]) -
+                     unique.begin();
+      for (size_t t = 0; t < 2; ++t)
+        for (size_t j = 0; j < 3; ++j)
+          triangles[6 * i + 3 * t + j] = corners[TRIANGLES[t][j]];
+    }
+  });
+
+  constexpr uint64_t MASK = (1 << 21) - 1;
+  vertices.resize(unique.size());
+  for (size_t i = 0; i < unique.size(); ++i)
+    vertices[i] = position(glm::ivec3(unique[i] >> 42, (unique[i] >> 21) & MASK,
+                                      unique[i] & MASK));
+}
+
+glm::vec3 MeshWriter::position(const glm::ivec3& corner) const {
+  return glm::vec3(_origin.x + _cellSize.x * corner.x,
+                   _origin.y + _cellSize.y * corner.y,
+                   _origin.z + _cellSize.z * corner.z);
+}
+
+}  // namespace model_scanner
@@ -1,170 +1,730 @@
 #include <model_scanner/Octree.h>
+#include <model_scanner/ThreadPool.h>
+#include <algorithm>
+#include <bit>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <iostream>
+#include <tuple>
 #include <glm/gtc/type_ptr.hpp>
 
 namespace model_scanner {
 
-Octree::Octree() {
+Octree::Octree() : _sparse(false), _boundSize(0), _shard(0), _numShards(1) {
   _header.depth = 0;
   _header.size = 0;
+  _header.sparse = 0;
 }
 
-Octree::Octree(glm::vec4 minPoint, glm::vec4 maxPoint, int depth) {
-  _nodeList.resize(depthToSize(depth));
-  _nodeList[0].total = 1;
-  _nodeList[0].hits = 0;
-  _nodeList[0].depth = 0;
-  _nodeList[0].minPoint = minPoint;
-  _nodeList[0].maxPoint = maxPoint;
-  for (size_t i = 1; i < _nodeList.size(); ++i) {
-    Node& node = _nodeList[i];
-    Node& parent = _nodeList[(i - 1) / 8];
-    node.total = 1;
-    node.hits = 0;
-    node.depth = parent.depth + 1;
-    node.minPoint.w = 1.0;
-    node.maxPoint.w = 1.0;
-    for (size_t j = 0; j < 3; ++j) {
-      if ((((i - 1) % 8) & (1 << j)) == 0) {
-        node.minPoint[j] = parent.minPoint[j];
-        node.maxPoint[j] = (parent.minPoint[j] + parent.maxPoint[j]) / 2;
-      } else {
-        node.minPoint[j] = (parent.minPoint[j] + parent.maxPoint[j]) / 2;
-        node.maxPoint[j] = parent.maxPoint[j];
-      }
-    }
+Octree::Octree(glm::vec4 minPoint, glm::vec4 maxPoint, int depth, bool sparse)
+  : _sparse(sparse), _boundSize(0), _shard(0), _numShards(1) {
+  if (depth > MAX_DEPTH) {
+    std::cerr << "Warning: Octree depth " << depth << " is above the maximum "
+              << "of " << MAX_DEPTH << ", using " << MAX_DEPTH << std::endl;
+    depth = MAX_DEPTH;
+  }
+  int denseDepth = _sparse ? std::min(depth, SPARSE_BASE_DEPTH) : depth;
+  size_t size = depthToSize(denseDepth);
+  _hits.assign(size, 0);
+  _total.assign(size, 1);
+  if (_sparse) {
+    _children.assign(size, 0);
+    for (size_t i = 0; i < depthToSize(denseDepth - 1); ++i)
+      _children[i] = 8 * i + 1;
   }
 
   _header.depth = depth;
-  _header.size = _nodeList.size();
+  _header.size = size;
+  _header.sparse = _sparse;
+  _header.minPoint = minPoint;
+  _header.maxPoint = maxPoint;
 }
 
 void Octree::clear() {
-  for (size_t i = 0; i < _nodeList.size(); ++i) {
-    Node& node = _nodeList[i];
-    node.total = 1;
-    node.hits = 1;
-  }
+  // Collapse back to the dense levels allocated up front
+  if (_sparse && _header.depth > SPARSE_BASE_DEPTH)
+    for (size_t i = depthToSize(SPARSE_BASE_DEPTH - 1);
+         i < depthToSize(SPARSE_BASE_DEPTH); ++i)
+      freeChildren(i);
+  std::fill(_hits.begin(), _hits.end(), 1);
+  std::fill(_total.begin(), _total.end(), 1);
+  restrictToShard(_shard, _numShards);
+}
+
+// Subdivides leaves that are neither carved away nor already solid, and
+// returns the subtrees of carved nodes to the pool. Solid nodes are written
+// whole, so their children would never be looked at.
+void Octree::refine(float threshold, uint32_t minSamples) {
+  if (!_sparse)
+    return;
+  refineNode(0, 0, threshold, minSamples);
+  _header.size = _hits.size();
+}
+
+// Stops counting nodes that have seen enough samples to be clearly carved
+// away, or finest leaves that are clearly solid. They keep their ratio, and
+// nothing below them is carved or written anymore, so every frame has less
+// left to do.
+void Octree::freeze(float threshold, uint32_t minSamples) {
+  freezeNode(0, 0, threshold, FREEZE_SAMPLE_FACTOR * minSamples);
+}
+
+bool Octree::isSparse() const {
+  return _sparse;
 }
 
 void Octree::update() {
-  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(Header),
-                     sizeof(Node) * _nodeList.size(), _nodeList.data());
+  size_t size = sizeof(uint32_t) * _header.size;
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(Header), size,
+                     _hits.data());
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(Header) + size, size,
+                     _total.data());
 }
 
 void Octree::bindData() {
-  glBufferData(GL_SHADER_STORAGE_BUFFER,
-               sizeof(Header) + sizeof(Node) * _nodeList.size(), nullptr,
+  glBufferData(GL_SHADER_STORAGE_BUFFER, bufferSize(), nullptr,
                GL_DYNAMIC_DRAW);
+  _boundSize = _header.size;
 }
 
 void Octree::bindSubData() {
+  if (_boundSize != _header.size)
+    bindData();
+  size_t size = sizeof(uint32_t) * _header.size;
   glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(Header), &_header);
-  glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(Header),
-                  sizeof(Node) * _nodeList.size(), _nodeList.data());
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(Header), size,
+                  _hits.data());
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(Header) + size, size,
+                  _total.data());
+  if (_sparse)
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(Header) + 2 * size, size,
+                    _children.data());
 }
 
-void Octree::write(const std::string& filename, float threshold) {
-  char header[80] = { 0 };
-  std::vector<std::array<glm::vec3, 3>> triangles = writeNode(0, threshold);
-  std::ofstream outFile(filename, std::ios::binary);
-  uint32_t numTris = triangles.size();
+namespace {
+
+// Corners are numbered by which of x, y and z (bits 0, 1 and 2) are at the
+// maximum, and go counterclockwise seen from outside the cube
+struct Face {
+  int normal[3];
+  uint8_t corners[4];
+};
+
+constexpr Face FACES[6] = {
+  { { 1, 0, 0 }, { 7, 5, 1, 3 } },  { { 0, 1, 0 }, { 7, 3, 2, 6 } },
+  { { 0, 0, 1 }, { 7, 6, 4, 5 } },  { { -1, 0, 0 }, { 0, 4, 6, 2 } },
+  { { 0, -1, 0 }, { 0, 1, 5, 4 } }, { { 0, 0, -1 }, { 0, 2, 3, 1 } },
+};
 
-  outFile.write(header, sizeof(header));
-  outFile.write((char*) &numTris, sizeof(uint32_t));
-  for (auto& tri : triangles) {
-    glm::vec3 normal = glm::cross(tri[0] - tri[1], tri[0] - tri[1]);
-    outFile.write((char*) glm::value_ptr(normal), 3 * sizeof(float));
-    for (auto& vertex : tri)
-      outFile.write((char*) glm::value_ptr(vertex), 3 * sizeof(float));
-    uint16_t attributeByteCount = 0;
-    outFile.write((char*) &attributeByteCount, sizeof(uint16_t));
+// Face f of the box from lo to hi, scaled up to cells of the finest level
+MeshWriter::Quad faceQuad(size_t f, const int32_t lo[3], const int32_t hi[3],
+                          int shift) {
+  MeshWriter::Quad quad;
+  for (size_t j = 0; j < 4; ++j) {
+    uint8_t c = FACES[f].corners[j];
+    quad.corners[j] = glm::ivec3((c & 1 ? hi[0] : lo[0]) << shift,
+                                 (c & 2 ? hi[1] : lo[1]) << shift,
+                                 (c & 4 ? hi[2] : lo[2]) << shift);
   }
+  quad.normal = glm::ivec3(FACES[f].normal[0], FACES[f].normal[1],
+                           FACES[f].normal[2]);
+  return quad;
 }
 
-std::vector<std::array<glm::vec3, 3>> Octree::writeNode(size_t idx,
-                                                        float threshold) {
-  Node& node = _nodeList[idx];
-  std::vector<std::array<glm::vec3, 3>> triangles;
-  if (isPartOf(idx, threshold)) {
-    glm::vec4 offset = node.maxPoint - node.minPoint;
-    glm::vec4 center = 0.5f * (_nodeList[0].maxPoint + _nodeList[0].minPoint);
-    glm::vec3 offsetX(offset.x, 0.0, 0.0);
-    glm::vec3 offsetY(0.0, offset.y, 0.0);
-    glm::vec3 offsetZ(0.0, 0.0, offset.z);
-    glm::vec3 min(node.minPoint.x - center.x, node.minPoint.y - center.y,
-                  node.minPoint.z - center.z);
-    glm::vec3 max(node.maxPoint.x - center.x, node.maxPoint.y - center.y,
-                  node.maxPoint.z - center.z);
-    size_t neighbor = -1;
-    // East  (+x)
-    neighbor = search(min + offsetX);
-    if (neighbor == -1 || !isPartOf(neighbor, threshold)) {
-      triangles.push_back({ max, max - offsetY, min + offsetX });
-      triangles.push_back({ max, min + offsetX, max - offsetZ });
-    }
-    // North (+y)
-    neighbor = search(min + offsetY);
-    if (neighbor == -1 || !isPartOf(neighbor, threshold)) {
-      triangles.push_back({ max, max - offsetZ, min + offsetY });
-      triangles.push_back({ max, min + offsetY, max - offsetX });
+size_t normalAxis(size_t f) {
+  return f % 3;
+}
+
+}  // namespace
+
+// The subtrees below WRITE_SPLIT_DEPTH are collected in parallel, then the
+// faces that are not hidden by a solid neighbor are found and handed to
+// the MeshWriter, merged into larger rectangles if asked to.
+void Octree::write(const std::string& filename, float threshold,
+                   bool mergeFaces, size_t numThreads) {
+  std::vector<Subtree> subtrees;
+  std::vector<std::vector<Cube>> parts(1);
+  collectCubes(0, { 0, 0, 0, 0, 0 }, threshold, parts[0], &subtrees);
+  parts.resize(subtrees.size() + 1);
+
+  ThreadPool pool(numThreads);
+  pool.parallelFor(subtrees.size(), [&](size_t idx, size_t) {
+    collectCubes(subtrees[idx].idx, subtrees[idx].cell, threshold,
+                 parts[idx + 1], nullptr);
+  });
+  pool.parallelFor(parts.size(), [&](size_t part, size_t) {
+    for (Cube& cube : parts[part])
+      cube.faces = visibleFaces(cube, threshold);
+  });
+
+  std::vector<MeshWriter::Quad> quads = mergeFaces ? mergedQuads(parts, pool)
+                                                   : faceQuads(parts, pool);
+
+  // Written relative to the middle of the octree
+  glm::vec3 minPoint(_header.minPoint);
+  glm::vec3 rootSize = glm::vec3(_header.maxPoint) - minPoint;
+  MeshWriter writer(pool, -0.5f * rootSize,
+                    rootSize / (float) (1 << _header.depth));
+  writer.write(filename, quads);
+}
+
+// One quad for every exposed face, with every part filling in its own
+// range
+std::vector<MeshWriter::Quad> Octree::faceQuads(
+    const std::vector<std::vector<Cube>>& parts, ThreadPool& pool) const {
+  std::vector<size_t> partOffsets(parts.size() + 1, 0);
+  for (size_t part = 0; part < parts.size(); ++part) {
+    size_t numFaces = 0;
+    for (const Cube& cube : parts[part])
+      numFaces += std::popcount(cube.faces);
+    partOffsets[part + 1] = partOffsets[part] + numFaces;
+  }
+
+  std::vector<MeshWriter::Quad> quads(partOffsets.back());
+  pool.parallelFor(parts.size(), [&](size_t part, size_t) {
+    MeshWriter::Quad* out = &quads[partOffsets[part]];
+    for (const Cube& cube : parts[part]) {
+      int32_t lo[3] = { cube.x, cube.y, cube.z };
+      int32_t hi[3] = { cube.x + 1, cube.y + 1, cube.z + 1 };
+      for (size_t f = 0; f < 6; ++f)
+        if (cube.faces & (1 << f))
+          *out++ = faceQuad(f, lo, hi, _header.depth - cube.depth);
     }
-    // Up    (+z)
-    neighbor = search(min + offsetZ);
-    if (neighbor == -1 || !isPartOf(neighbor, threshold)) {
-      triangles.push_back({ max, max - offsetX, min + offsetZ });
-      triangles.push_back({ max, min + offsetZ, max - offsetY });
+  });
+  return quads;
+}
+
+// Greedy meshing: faces of cubes at the same depth that lie in the same
+// plane are sorted by row, and every face not yet covered grows into the
+// widest run along its row, which then grows into as many following rows
+// as have the same run
+std::vector<MeshWriter::Quad> Octree::mergedQuads(
+    const std::vector<std::vector<Cube>>& parts, ThreadPool& pool) const {
+  std::vector<FaceCell> cells;
+  for (const std::vector<Cube>& part : parts) {
+    for (const Cube& cube : part) {
+      int32_t pos[3] = { cube.x, cube.y, cube.z };
+      for (size_t f = 0; f < 6; ++f) {
+        if ((cube.faces & (1 << f)) == 0)
+          continue;
+        size_t a = normalAxis(f);
+        uint64_t plane = f | (uint64_t) cube.depth << 3 |
+                         (uint64_t) pos[a] << 8;
+        cells.push_back({ plane, pos[(a + 1) % 3], pos[(a + 2) % 3] });
+      }
     }
-    // West  (-x)
-    neighbor = search(min - offsetX);
-    if (neighbor == -1 || !isPartOf(neighbor, threshold)) {
-      triangles.push_back({ min, min + offsetZ, max - offsetX });
-      triangles.push_back({ min, max - offsetX, min + offsetY });
+  }
+  std::sort(cells.begin(), cells.end(),
+            [](const FaceCell& a, const FaceCell& b) {
+              return std::tie(a.plane, a.v, a.u) <
+                     std::tie(b.plane, b.v, b.u);
+            });
+
+  std::vector<size_t> planeStarts;
+  for (size_t i = 0; i < cells.size(); ++i)
+    if (i == 0 || cells[i].plane != cells[i - 1].plane)
+      planeStarts.push_back(i);
+  planeStarts.push_back(cells.size());
+
+  std::vector<std::vector<MeshWriter::Quad>> planeQuads(planeStarts.size() -
+                                                        1);
+  pool.parallelFor(planeQuads.size(), [&](size_t p, size_t) {
+    auto begin = cells.begin() + planeStarts[p];
+    auto end = cells.begin() + planeStarts[p + 1];
+    std::vector<bool> used(end - begin, false);
+    auto find = [&](int32_t u, int32_t v) {
+      FaceCell key = { begin->plane, u, v };
+      auto it = std::lower_bound(begin, end, key,
+                                 [](const FaceCell& a, const FaceCell& b) {
+                                   return std::tie(a.v, a.u) <
+                                          std::tie(b.v, b.u);
+                                 });
+      return (it != end && it->u == u && it->v == v) ? it - begin : -1;
+    };
+
+    size_t f = begin->plane & 7;
+    int depth = (begin->plane >> 3) & 31;
+    int32_t coord = begin->plane >> 8;
+    size_t a = normalAxis(f);
+    for (ptrdiff_t i = 0; i < end - begin; ++i) {
+      if (used[i])
+        continue;
+      int32_t u = begin[i].u;
+      int32_t v = begin[i].v;
+      ptrdiff_t w = 1;
+      while (i + w < end - begin && begin[i + w].v == v &&
+             begin[i + w].u == u + w && !used[i + w])
+        ++w;
+      std::fill(used.begin() + i, used.begin() + i + w, true);
+
+      int32_t h = 1;
+      for (;; ++h) {
+        ptrdiff_t row = find(u, v + h);
+        if (row < 0 || row + w > end - begin)
+          break;
+        bool full = true;
+        for (ptrdiff_t k = 0; k < w && full; ++k)
+          full = begin[row + k].v == v + h && begin[row + k].u == u + k &&
+                 !used[row + k];
+        if (!full)
+          break;
+        std::fill(used.begin() + row, used.begin() + row + w, true);
+      }
+
+      int32_t lo[3], hi[3];
+      lo[a] = coord;
+      hi[a] = coord + 1;
+      lo[(a + 1) % 3] = u;
+      hi[(a + 1) % 3] = u + w;
+      lo[(a + 2) % 3] = v;
+      hi[(a + 2) % 3] = v + h;
+      planeQuads[p].push_back(faceQuad(f, lo, hi, _header.depth - depth));
     }
-    // South (-y)
-    neighbor = search(min - offsetY);
-    if (neighbor == -1 || !isPartOf(neighbor, threshold)) {
-      triangles.push_back({ min, min + offsetX, max - offsetY });
-      triangles.push_back({ min, max - offsetY, min + offsetZ });
+  });
+
+  std::vector<MeshWriter::Quad> quads;
+  for (const std::vector<MeshWriter::Quad>& part : planeQuads)
+    quads.insert(quads.end(), part.begin(), part.end());
+  return quads;
+}
+
+// Stops at WRITE_SPLIT_DEPTH and leaves the rest to the caller when given
+// subtrees
+void Octree::collectCubes(size_t idx, const Cube& cell, float threshold,
+                          std::vector<Cube>& cubes,
+                          std::vector<Subtree>* subtrees) const {
+  if (isPartOf(idx, threshold)) {
+    cubes.push_back(cell);
+    return;
+  }
+  size_t c = firstChild(idx, cell.depth);
+  if (c == 0 || isFrozen(idx))
+    return;
+  if (subtrees && cell.depth == WRITE_SPLIT_DEPTH) {
+    subtrees->push_back({ idx, cell });
+    return;
+  }
+  for (int i = 0; i < 8; ++i) {
+    Cube child = { 2 * cell.x + (i & 1), 2 * cell.y + ((i >> 1) & 1),
+                   2 * cell.z + ((i >> 2) & 1), cell.depth + 1, 0 };
+    collectCubes(c + i, child, threshold, cubes, subtrees);
+  }
+}
+
+uint8_t Octree::visibleFaces(const Cube& cube, float threshold) const {
+  uint8_t faces = 0;
+  for (size_t f = 0; f < 6; ++f) {
+    const int* normal = FACES[f].normal;
+    if (!isSolidAt(cube.x + normal[0], cube.y + normal[1], cube.z + normal[2],
+                   cube.depth, threshold))
+      faces |= 1 << f;
+  }
+  return faces;
+}
+
+// Whether the cell at the given depth is inside a node that is written as a
+// whole. A cell that is subdivided further counts as not solid.
+bool Octree::isSolidAt(int32_t x, int32_t y, int32_t z, int depth,
+                       float threshold) const {
+  int32_t cells = 1 << depth;
+  if (x < 0 || y < 0 || z < 0 || x >= cells || y >= cells || z >= cells)
+    return false;
+
+  size_t current = 0;
+  for (int level = 0;; ++level) {
+    if (isPartOf(current, threshold))
+      return true;
+    size_t children = firstChild(current, level);
+    if (children == 0 || level == depth || isFrozen(current))
+      return false;
+    int shift = depth - 1 - level;
+    size_t octant = ((x >> shift) & 1) | ((y >> shift) & 1) << 1 |
+                    ((z >> shift) & 1) << 2;
+    current = children + octant;
+  }
+}
+
+// Written next to the file first, so a crash while saving leaves the last
+// checkpoint as it was
+bool Octree::save(const std::string& filename) const {
+  FileHeader header = {};
+  std::memcpy(header.magic, FILE_MAGIC, sizeof(header.magic));
+  header.version = FILE_VERSION;
+  header.depth = _header.depth;
+  header.sparse = _sparse;
+  header.counterBits = 8 * sizeof(uint32_t);
+  header.size = _header.size;
+  header.numFreeBlocks = _freeBlocks.size();
+  for (int i = 0; i < 4; ++i) {
+    header.minPoint[i] = _header.minPoint[i];
+    header.maxPoint[i] = _header.maxPoint[i];
+  }
+
+  std::string tmpFilename = filename + ".tmp";
+  std::ofstream outFile(tmpFilename, std::ios::binary);
+  size_t size = sizeof(uint32_t) * _header.size;
+  outFile.write((const char*) &header, sizeof(header));
+  outFile.write((const char*) _hits.data(), size);
+  outFile.write((const char*) _total.data(), size);
+  if (_sparse) {
+    outFile.write((const char*) _children.data(), size);
+    outFile.write((const char*) _freeBlocks.data(),
+                  sizeof(uint32_t) * _freeBlocks.size());
+  }
+  outFile.close();
+  if (!outFile || std::rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+    std::cerr << "Error: Could not write " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Maps the file and copies the counters straight out of the mapping
+bool Octree::load(const std::string& filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Error: Could not open " << filename << std::endl;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(FileHeader)) {
+    std::cerr << "Error: " << filename << " is not an octree" << std::endl;
+    close(fd);
+    return false;
+  }
+  size_t fileSize = st.st_size;
+  void* data = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << "Error: Could not map " << filename << std::endl;
+    return false;
+  }
+
+  FileHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  const uint32_t* arrays = (const uint32_t*) ((const char*) data +
+                                              sizeof(FileHeader));
+  size_t numArrays = header.sparse ? 3 : 2;
+  // The sizes are bounded before they are multiplied, so nothing wraps
+  bool valid =
+      std::memcmp(header.magic, FILE_MAGIC, sizeof(header.magic)) == 0 &&
+      header.version == FILE_VERSION && header.counterBits == 32 &&
+      header.depth <= MAX_DEPTH && header.size <= UINT32_MAX &&
+      header.numFreeBlocks <= header.size &&
+      fileSize == sizeof(FileHeader) +
+                      sizeof(uint32_t) * (numArrays * header.size +
+                                          header.numFreeBlocks);
+  if (valid && header.sparse)
+    valid = validLinks(arrays + 2 * header.size, arrays + 3 * header.size,
+                       header.size, header.numFreeBlocks, header.depth);
+  else if (valid)
+    valid = header.size == depthToSize(header.depth) &&
+            header.numFreeBlocks == 0;
+  if (!valid) {
+    std::cerr << "Error: " << filename << " is not an octree of version "
+              << FILE_VERSION << std::endl;
+    munmap(data, fileSize);
+    return false;
+  }
+
+  _sparse = header.sparse;
+  _shard = 0;
+  _numShards = 1;
+  _header.depth = header.depth;
+  _header.size = header.size;
+  _header.sparse = header.sparse;
+  for (int i = 0; i < 4; ++i) {
+    _header.minPoint[i] = header.minPoint[i];
+    _header.maxPoint[i] = header.maxPoint[i];
+  }
+  _hits.assign(arrays, arrays + header.size);
+  _total.assign(arrays + header.size, arrays + 2 * header.size);
+  if (_sparse) {
+    _children.assign(arrays + 2 * header.size, arrays + 3 * header.size);
+    _freeBlocks.assign(arrays + 3 * header.size,
+                       arrays + 3 * header.size + header.numFreeBlocks);
+  } else {
+    _children.clear();
+    _freeBlocks.clear();
+  }
+  munmap(data, fileSize);
+  return true;
+}
+
+bool Octree::merge(const Octree& other) {
+  if (!sameVolume(other)) {
+    std::cerr << "Error: Only octrees of the same depth and bounds can be "
+              << "merged" << std::endl;
+    return false;
+  }
+  mergeNode(0, 0, other, 0);
+  _header.size = _hits.size();
+  return true;
+}
+
+void Octree::restrictToShard(size_t shard, size_t numShards) {
+  if (numShards <= 1 || (int) _header.depth < SHARD_DEPTH)
+    return;
+  _shard = shard;
+  _numShards = numShards;
+  size_t first = depthToSize(SHARD_DEPTH - 1);
+  for (size_t i = first; i < depthToSize(SHARD_DEPTH); ++i)
+    if ((i - first) % numShards != shard)
+      _total[i] |= FROZEN;
+}
+
+bool Octree::stitch(const Octree& other, size_t shard, size_t numShards) {
+  if (!sameVolume(other)) {
+    std::cerr << "Error: Only octrees of the same depth and bounds can be "
+              << "stitched" << std::endl;
+    return false;
+  }
+  size_t first = depthToSize(SHARD_DEPTH - 1);
+  for (size_t i = first; i < depthToSize(SHARD_DEPTH); ++i)
+    if ((i - first) % numShards == shard)
+      copyNode(i, SHARD_DEPTH, other, i);
+  _header.size = _hits.size();
+  return true;
+}
+
+bool Octree::sameVolume(const Octree& other) const {
+  return _header.depth == other._header.depth && _sparse == other._sparse &&
+         _header.minPoint == other._header.minPoint &&
+         _header.maxPoint == other._header.maxPoint;
+}
+
+bool Octree::isPartOf(size_t idx, float threshold) const {
+  return (float) _hits[idx] / total(idx) >= threshold;
+}
+
+bool Octree::isFrozen(size_t idx) const {
+  return _total[idx] & FROZEN;
+}
+
+uint32_t Octree::total(size_t idx) const {
+  return _total[idx] & ~FROZEN;
+}
+
+size_t Octree::firstChild(size_t idx, int depth) const {
+  if (_sparse)
+    return _children[idx];
+  return depth < (int) _header.depth ? 8 * idx + 1 : 0;
+}
+
+Octree::Box Octree::rootBox() const {
+  return { glm::vec3(_header.minPoint), glm::vec3(_header.maxPoint) };
+}
+
+Octree::Box Octree::Box::child(size_t octant) const {
+  Box box;
+  for (size_t j = 0; j < 3; ++j) {
+    if ((octant & (1 << j)) == 0) {
+      box.minPoint[j] = minPoint[j];
+      box.maxPoint[j] = (minPoint[j] + maxPoint[j]) / 2;
+    } else {
+      box.minPoint[j] = (minPoint[j] + maxPoint[j]) / 2;
+      box.maxPoint[j] = maxPoint[j];
     }
-    // Down  (-z)
-    neighbor = search(min - offsetZ);
-    if (neighbor == -1 || !isPartOf(neighbor, threshold)) {
-      triangles.push_back({ min, min + offsetY, max - offsetZ });
-      triangles.push_back({ min, max - offsetZ, min + offsetX });
+  }
+  return box;
+}
+
+void Octree::allocateChildren(size_t idx) {
+  uint32_t children;
+  if (_freeBlocks.empty()) {
+    children = _hits.size();
+    _hits.resize(_hits.size() + 8);
+    _total.resize(_total.size() + 8);
+    _children.resize(_children.size() + 8);
+  } else {
+    children = _freeBlocks.back();
+    _freeBlocks.pop_back();
+  }
+  _children[idx] = children;
+  for (size_t i = children; i < children + 8; ++i) {
+    _hits[i] = 0;
+    _total[i] = 1;
+    _children[i] = 0;
+  }
+}
+
+void Octree::freeChildren(size_t idx) {
+  uint32_t children = _children[idx];
+  if (children == 0)
+    return;
+  for (size_t i = 0; i < 8; ++i)
+    freeChildren(children + i);
+  _children[idx] = 0;
+  _freeBlocks.push_back(children);
+}
+
+void Octree::refineNode(size_t idx, int depth, float threshold,
+                        uint32_t minSamples) {
+  bool decided = total(idx) >= minSamples;
+  bool carved = decided && !isPartOf(idx, CARVED_RATIO);
+  if (carved && depth >= SPARSE_BASE_DEPTH) {
+    freeChildren(idx);
+  } else if (_children[idx] != 0) {
+    for (size_t i = 0; i < 8; ++i)
+      refineNode(_children[idx] + i, depth + 1, threshold, minSamples);
+  } else if (decided && !carved && !isPartOf(idx, threshold) &&
+             depth < (int) _header.depth) {
+    allocateChildren(idx);
+  }
+}
+
+// The ratio of a node with children also counts the parts of it that are
+// empty, so only leaves are frozen by being carved away, and nodes above
+// them once all their children are. Returns whether the node is frozen as
+// carved away.
+bool Octree::freezeNode(size_t idx, int depth, float threshold,
+                        uint32_t minSamples) {
+  if (isFrozen(idx))
+    return !isPartOf(idx, threshold);
+  bool decided = total(idx) >= minSamples;
+  size_t c = firstChild(idx, depth);
+  // Every shard has to keep carving the levels above the shards
+  if (_numShards > 1 && depth < SHARD_DEPTH) {
+    for (size_t i = 0; i < 8; ++i)
+      freezeNode(c + i, depth + 1, threshold, minSamples);
+    return false;
+  }
+  if (c == 0 && depth == int(_header.depth) && decided &&
+      isPartOf(idx, threshold + FREEZE_MARGIN)) {
+    _total[idx] |= FROZEN;
+    return false;
+  }
+
+  bool carved = true;
+  if (c == 0) {
+    carved = decided && !isPartOf(idx, CARVED_RATIO);
+  } else {
+    for (size_t i = 0; i < 8; ++i)
+      carved &= freezeNode(c + i, depth + 1, threshold, minSamples);
+  }
+  if (carved)
+    _total[idx] |= FROZEN;
+  return carved;
+}
+
+// Where only one of the sparse trees is subdivided, its children get the
+// counts of the node in the other one. The merged nodes are not frozen.
+void Octree::mergeNode(size_t idx, int depth, const Octree& other,
+                       size_t otherIdx) {
+  uint32_t hits = _hits[idx];
+  uint32_t total = this->total(idx);
+  uint32_t otherHits = other._hits[otherIdx];
+  uint32_t otherTotal = other.total(otherIdx);
+  sumCounts(idx, otherHits, otherTotal);
+
+  size_t c = firstChild(idx, depth);
+  size_t otherC = other.firstChild(otherIdx, depth);
+  if (c == 0 && otherC != 0) {
+    allocateChildren(idx);
+    c = _children[idx];
+    for (size_t i = c; i < c + 8; ++i) {
+      _hits[i] = hits;
+      _total[i] = total;
     }
-  } else if (node.depth != _header.depth) {
-    std::array<std::vector<std::array<glm::vec3, 3>>, 8> childrenTris = {
-      writeNode(8 * idx + 1, threshold), writeNode(8 * idx + 2, threshold),
-      writeNode(8 * idx + 3, threshold), writeNode(8 * idx + 4, threshold),
-      writeNode(8 * idx + 5, threshold), writeNode(8 * idx + 6, threshold),
-      writeNode(8 * idx + 7, threshold), writeNode(8 * idx + 8, threshold)
-    };
-    size_t size = 0;
-    for (auto& triList : childrenTris)
-      size += triList.size();
-    triangles.reserve(size);
-    for (auto& triList : childrenTris)
-      triangles.insert(triangles.end(), triList.begin(), triList.end());
   }
-  return triangles;
+  if (c == 0)
+    return;
+  for (size_t i = 0; i < 8; ++i) {
+    if (otherC != 0)
+      mergeNode(c + i, depth + 1, other, otherC + i);
+    else
+      addCounts(c + i, depth + 1, otherHits, otherTotal);
+  }
+}
+
+// Replaces the subtree with the other one, the nodes of frozen ones
+// included
+void Octree::copyNode(size_t idx, int depth, const Octree& other,
+                      size_t otherIdx) {
+  _hits[idx] = other._hits[otherIdx];
+  _total[idx] = other._total[otherIdx];
+  size_t otherC = other.firstChild(otherIdx, depth);
+  if (otherC == 0) {
+    if (_sparse)
+      freeChildren(idx);
+    return;
+  }
+  if (firstChild(idx, depth) == 0)
+    allocateChildren(idx);
+  size_t c = firstChild(idx, depth);
+  for (size_t i = 0; i < 8; ++i)
+    copyNode(c + i, depth + 1, other, otherC + i);
+}
+
+void Octree::addCounts(size_t idx, int depth, uint32_t hits,
+                       uint32_t total) {
+  sumCounts(idx, hits, total);
+  size_t c = firstChild(idx, depth);
+  if (c == 0)
+    return;
+  for (size_t i = 0; i < 8; ++i)
+    addCounts(c + i, depth + 1, hits, total);
 }
 
-size_t Octree::search(glm::vec3 point, size_t current) {
-  if (_nodeList[current].depth == _header.depth)
-    return current;
-  for (size_t i = 8 * current + 1; i <= 8 * current + 8; ++i) {
-    Node& node = _nodeList[i];
-    if (node.minPoint.x <= point.x && point.x < node.maxPoint.x &&
-        node.minPoint.y <= point.y && point.y < node.maxPoint.y &&
-        node.minPoint.z <= point.z && point.z < node.maxPoint.z)
-      return search(point, i);
+// Sums that would reach FROZEN are halved together, which keeps their
+// ratio, the only thing the counts are used for. Like reduce.glsl.
+void Octree::sumCounts(size_t idx, uint32_t hits, uint32_t total) {
+  uint64_t sumHits = (uint64_t) _hits[idx] + hits;
+  uint64_t sumTotal = (uint64_t) this->total(idx) + total;
+  while (sumHits >= FROZEN || sumTotal >= FROZEN) {
+    sumHits >>= 1;
+    sumTotal >>= 1;
+  }
+  _hits[idx] = sumHits;
+  _total[idx] = sumTotal;
+}
+
+// Every block of children has to be reached from the root once, above the
+// leaf depth, and free blocks have to be blocks nothing uses. A child can
+// come before its parent once freed blocks are reused, so walking the tree
+// is what rules out cycles.
+bool Octree::validLinks(const uint32_t* children, const uint32_t* freeBlocks,
+                        size_t size, size_t numFreeBlocks, int depth) {
+  int denseDepth = std::min(depth, SPARSE_BASE_DEPTH);
+  if (size < depthToSize(denseDepth) || size % 8 != 1)
+    return false;
+  for (size_t i = 0; i < depthToSize(denseDepth - 1); ++i)
+    if (children[i] != 8 * i + 1)
+      return false;
+
+  // Blocks start at 8 * b + 1
+  std::vector<bool> used(size / 8, false);
+  auto claim = [&](uint32_t c) {
+    if (c % 8 != 1 || c + 8 > size || used[c / 8])
+      return false;
+    used[c / 8] = true;
+    return true;
+  };
+  std::vector<std::pair<size_t, int>> stack = { { 0, 0 } };
+  while (!stack.empty()) {
+    auto [idx, nodeDepth] = stack.back();
+    stack.pop_back();
+    uint32_t c = children[idx];
+    if (c == 0)
+      continue;
+    if (nodeDepth >= depth || !claim(c))
+      return false;
+    for (size_t i = 0; i < 8; ++i)
+      stack.push_back({ c + i, nodeDepth + 1 });
   }
-  return -1;
+  for (size_t i = 0; i < numFreeBlocks; ++i)
+    if (!claim(freeBlocks[i]))
+      return false;
+  return true;
 }
 
-bool Octree::isPartOf(size_t idx, float threshold) {
-  return (float) _nodeList[idx].hits / _nodeList[idx].total >= threshold;
+size_t Octree::bufferSize() const {
+  return sizeof(Header) + sizeof(uint32_t) * _header.size * (_sparse ? 3 : 2);
 }
 
 size_t Octree::depthToSize(int depth) {
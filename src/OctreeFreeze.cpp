@@ -0,0 +1,45 @@
+#include <model_scanner/OctreeFreeze.h>
+
+namespace model_scanner {
+
+OctreeFreeze::OctreeFreeze(const Octree& octree)
+  : _octree(octree), _prog(0) {}
+
+void OctreeFreeze::initGL(GLuint program) {
+  _prog = program;
+  _firstLoc = glGetUniformLocation(_prog, "first");
+  _lastLoc = glGetUniformLocation(_prog, "last");
+  _leavesLoc = glGetUniformLocation(_prog, "leaves");
+  _thresholdLoc = glGetUniformLocation(_prog, "threshold");
+  _solidRatioLoc = glGetUniformLocation(_prog, "solidRatio");
+  _carvedRatioLoc = glGetUniformLocation(_prog, "carvedRatio");
+  _minSamplesLoc = glGetUniformLocation(_prog, "minSamples");
+}
+
+void OctreeFreeze::run(GLuint octreeSsbo, float threshold,
+                       uint32_t minSamples) {
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  glUseProgram(_prog);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, octreeSsbo);
+  glUniform1f(_thresholdLoc, threshold);
+  glUniform1f(_solidRatioLoc, threshold + Octree::FREEZE_MARGIN);
+  glUniform1f(_carvedRatioLoc, Octree::CARVED_RATIO);
+  glUniform1ui(_minSamplesLoc, Octree::FREEZE_SAMPLE_FACTOR * minSamples);
+
+  // Every shard has to keep carving the levels above the shards
+  int depth = _octree._header.depth;
+  int minDepth = _octree._numShards > 1 ? Octree::SHARD_DEPTH : 0;
+  for (int level = depth; level >= minDepth; --level) {
+    size_t first = Octree::depthToSize(level - 1);
+    size_t last = Octree::depthToSize(level);
+    glUniform1ui(_firstLoc, first);
+    glUniform1ui(_lastLoc, last);
+    glUniform1i(_leavesLoc, level == depth);
+    glDispatchCompute((last - first + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE,
+                      1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  }
+  glUseProgram(0);
+}
+
+}  // namespace model_scanner
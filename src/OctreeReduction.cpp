@@ -0,0 +1,48 @@
+#include <model_scanner/OctreeReduction.h>
+
+namespace model_scanner {
+
+OctreeReduction::OctreeReduction(const Octree& octree)
+  : _octree(octree), _prog(0), _reduced(false) {}
+
+void OctreeReduction::initGL(GLuint program) {
+  _prog = program;
+  _firstLoc = glGetUniformLocation(_prog, "first");
+  _lastLoc = glGetUniformLocation(_prog, "last");
+}
+
+void OctreeReduction::run(GLuint octreeSsbo) {
+  if (_reduced)
+    return;
+  _reduced = true;
+
+  // The counters were written by the carving pass
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  glUseProgram(_prog);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, octreeSsbo);
+  int depth = _octree._header.depth;
+  if (_octree.isSparse()) {
+    // Pooled nodes are in no particular order, but after n passes over all
+    // of them every node with n levels below it is done
+    for (int i = 0; i < depth; ++i)
+      dispatch(0, _octree._header.size);
+  } else {
+    for (int level = depth - 1; level >= 0; --level)
+      dispatch(Octree::depthToSize(level - 1), Octree::depthToSize(level));
+  }
+  glUseProgram(0);
+}
+
+void OctreeReduction::invalidate() {
+  _reduced = false;
+}
+
+void OctreeReduction::dispatch(size_t first, size_t last) {
+  glUniform1ui(_firstLoc, first);
+  glUniform1ui(_lastLoc, last);
+  glDispatchCompute((last - first + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1,
+                    1);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+}  // namespace model_scanner
@@ -0,0 +1,137 @@
+#include <model_scanner/OctreeSync.h>
+#include <algorithm>
+
+namespace model_scanner {
+
+OctreeSync::OctreeSync(Octree& octree)
+  : _octree(octree),
+    _prog(0),
+    _solidSsbo(0),
+    _changeSsbo(0),
+    _fence(nullptr),
+    _size(0),
+    _full(true),
+    _pendingFull(false) {}
+
+void OctreeSync::initGL(GLuint program) {
+  _prog = program;
+  _thresholdLoc = glGetUniformLocation(_prog, "threshold");
+  GLuint buffers[2];
+  glGenBuffers(2, buffers);
+  _solidSsbo = buffers[0];
+  _changeSsbo = buffers[1];
+}
+
+void OctreeSync::start(GLuint octreeSsbo, float threshold) {
+  if (_fence)
+    wait();
+
+  size_t size = _octree._header.size;
+  if (size != _size) {
+    _size = size;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _solidSsbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER,
+                 sizeof(uint32_t) * ((size + 31) / 32), nullptr,
+                 GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _changeSsbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(uint32_t) * (size + 1),
+                 nullptr, GL_DYNAMIC_READ);
+    _full = true;
+  }
+
+  uint32_t zero = 0;
+  if (_full) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _solidSsbo);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER,
+                      GL_UNSIGNED_INT, &zero);
+  }
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _changeSsbo);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(uint32_t), &zero);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, octreeSsbo);
+
+  // The counters were written by the carving pass
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  glUseProgram(_prog);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, octreeSsbo);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, _solidSsbo);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _changeSsbo);
+  glUniform1f(_thresholdLoc, threshold);
+  glDispatchCompute((size + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+  glUseProgram(0);
+  glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+  _fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  _pendingFull = _full;
+  _full = false;
+}
+
+bool OctreeSync::poll() {
+  if (!_fence)
+    return false;
+  GLenum result = glClientWaitSync(_fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+  if (result == GL_TIMEOUT_EXPIRED)
+    return false;
+  apply();
+  return true;
+}
+
+void OctreeSync::wait() {
+  if (!_fence)
+    return;
+  GLenum result;
+  do {
+    result = glClientWaitSync(_fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+  } while (result == GL_TIMEOUT_EXPIRED);
+  apply();
+}
+
+bool OctreeSync::pending() const {
+  return _fence != nullptr;
+}
+
+bool OctreeSync::reset() {
+  bool dropped = _fence != nullptr;
+  if (_fence) {
+    glDeleteSync(_fence);
+    _fence = nullptr;
+  }
+  _full = true;
+  return dropped;
+}
+
+void OctreeSync::release() {
+  if (_fence) {
+    glDeleteSync(_fence);
+    _fence = nullptr;
+  }
+}
+
+// The pass is done, so only the changes themselves are transferred
+void OctreeSync::apply() {
+  glDeleteSync(_fence);
+  _fence = nullptr;
+
+  uint32_t count;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _changeSsbo);
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(uint32_t), &count);
+  _changes.resize(count);
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(uint32_t),
+                     sizeof(uint32_t) * count, _changes.data());
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+  // The change list has no FROZEN bits, so the CPU copy keeps the ones it
+  // had. Nodes OctreeFreeze froze on the GPU only show up with the next full
+  // readback, which is all that checkpoints and refinement look at.
+  if (_pendingFull) {
+    std::fill(_octree._hits.begin(), _octree._hits.end(), 0);
+    for (uint32_t& total : _octree._total)
+      total = 1 | (total & Octree::FROZEN);
+  }
+  for (uint32_t change : _changes) {
+    uint32_t idx = change & ~SOLID_BIT;
+    _octree._hits[idx] = (change & SOLID_BIT) ? 1 : 0;
+    _octree._total[idx] = 1 | (_octree._total[idx] & Octree::FROZEN);
+  }
+}
+
+}  // namespace model_scanner
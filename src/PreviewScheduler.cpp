@@ -0,0 +1,40 @@
+#include <model_scanner/PreviewScheduler.h>
+#include <algorithm>
+#include <cmath>
+
+namespace model_scanner {
+
+PreviewScheduler::PreviewScheduler(size_t interval)
+  : _interval(std::max<size_t>(interval, 1)),
+    _framesSince(0),
+    _carvedSince(0),
+    _pose(1.0),
+    _stale(true) {}
+
+bool PreviewScheduler::due(const glm::mat4& pose) {
+  if (++_framesSince < _interval)
+    return false;
+
+  float moved = 0.0;
+  for (int i = 0; i < 4; ++i)
+    for (int j = 0; j < 4; ++j)
+      moved = std::max(moved, std::abs(pose[i][j] - _pose[i][j]));
+  if (!_stale && moved < POSE_EPSILON && _carvedSince < _interval)
+    return false;
+
+  _framesSince = 0;
+  _carvedSince = 0;
+  _pose = pose;
+  _stale = false;
+  return true;
+}
+
+void PreviewScheduler::carved() {
+  ++_carvedSince;
+}
+
+void PreviewScheduler::invalidate() {
+  _stale = true;
+}
+
+}  // namespace model_scanner
@@ -0,0 +1,155 @@
+#include <model_scanner/Profiler.h>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+namespace model_scanner {
+
+namespace {
+
+const char* STAGE_NAMES[Profiler::NUM_STAGES] = {
+  "capture",       "undistort",  "detect",      "upload",
+  "carve",         "readback",   "frame",       "gpu undistort",
+  "gpu render",    "gpu carve",  "gpu preview", "gpu readback",
+};
+
+double percentile(std::vector<double>& values, double p) {
+  size_t idx = std::min(values.size() - 1, size_t(p * values.size()));
+  std::nth_element(values.begin(), values.begin() + idx, values.end());
+  return values[idx];
+}
+
+}  // namespace
+
+Profiler& Profiler::instance() {
+  static Profiler profiler;
+  return profiler;
+}
+
+Profiler::Profiler()
+  : _epoch(Clock::now()), _lastFrame(_epoch), _frames(0), _tracing(false) {}
+
+void Profiler::record(Stage stage, Clock::time_point start,
+                      Clock::time_point end) {
+  std::chrono::duration<double, std::milli> ms = end - start;
+  addSample(stage, start, ms.count(), threadIndex());
+}
+
+void Profiler::beginGpu(Stage stage) {
+  GpuQueries& gpu = _gpu[stage];
+  if (gpu.queries[0] == 0)
+    glGenQueries(2, gpu.queries);
+  size_t slot = gpu.next & 1;
+  if (gpu.issued[slot]) {
+    GLint available = 0;
+    glGetQueryObjectiv(gpu.queries[slot], GL_QUERY_RESULT_AVAILABLE,
+                       &available);
+    // A result that is still not in after two frames is dropped
+    if (available) {
+      GLuint64 ns = 0;
+      glGetQueryObjectui64v(gpu.queries[slot], GL_QUERY_RESULT, &ns);
+      addSample(stage, gpu.started[slot], ns / 1e6, GPU_THREAD);
+    }
+  }
+  gpu.started[slot] = Clock::now();
+  glBeginQuery(GL_TIME_ELAPSED, gpu.queries[slot]);
+}
+
+void Profiler::endGpu(Stage stage) {
+  GpuQueries& gpu = _gpu[stage];
+  glEndQuery(GL_TIME_ELAPSED);
+  gpu.issued[gpu.next & 1] = true;
+  ++gpu.next;
+}
+
+void Profiler::endFrame() {
+  Clock::time_point now = Clock::now();
+  record(FRAME, _lastFrame, now);
+  _lastFrame = now;
+  if (++_frames % SUMMARY_INTERVAL == 0)
+    printSummary();
+}
+
+void Profiler::startTrace() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _events.clear();
+  _tracing = true;
+}
+
+bool Profiler::stopTrace(const std::string& filename) {
+  std::vector<Event> events;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _tracing = false;
+    events.swap(_events);
+  }
+
+  std::ofstream out(filename);
+  if (!out) {
+    std::cerr << "Error: Unable to open " << filename << std::endl;
+    return false;
+  }
+  // GPU events start when their query was issued, the GPU may have run them
+  // later than that
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+      << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+      << GPU_THREAD << ",\"args\":{\"name\":\"GPU\"}}";
+  out << std::fixed << std::setprecision(3);
+  for (const Event& event : events)
+    out << ",\n{\"name\":\"" << STAGE_NAMES[event.stage]
+        << "\",\"cat\":\"" << (event.thread == GPU_THREAD ? "gpu" : "cpu")
+        << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+        << ",\"ts\":" << event.startUs << ",\"dur\":" << event.durationUs
+        << "}";
+  out << "\n]}\n";
+  if (!out) {
+    std::cerr << "Error: Unable to write " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool Profiler::tracing() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _tracing;
+}
+
+void Profiler::addSample(Stage stage, Clock::time_point start, double ms,
+                         int thread) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  Samples& samples = _samples[stage];
+  samples.ms[samples.count++ % WINDOW_SIZE] = ms;
+  if (_tracing && _events.size() < MAX_TRACE_EVENTS) {
+    std::chrono::duration<double, std::micro> startUs = start - _epoch;
+    _events.push_back({ stage, startUs.count(), ms * 1e3, thread });
+  }
+}
+
+void Profiler::printSummary() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::cout << "Stage times over the last frames, p50/p99 ms:";
+  std::cout << std::fixed << std::setprecision(2);
+  std::vector<double> values;
+  for (size_t i = 0; i < NUM_STAGES; ++i) {
+    const Samples& samples = _samples[i];
+    if (samples.count == 0)
+      continue;
+    values.assign(samples.ms.begin(),
+                  samples.ms.begin() + std::min(samples.count, WINDOW_SIZE));
+    double p50 = percentile(values, 0.5);
+    double p99 = percentile(values, 0.99);
+    std::cout << " " << STAGE_NAMES[i] << " " << p50 << "/" << p99;
+  }
+  std::cout << std::defaultfloat << std::endl;
+}
+
+// Small, stable thread ids for the trace, 0 being the GPU
+int Profiler::threadIndex() {
+  static std::atomic<int> nextIndex{ GPU_THREAD + 1 };
+  thread_local int index = nextIndex++;
+  return index;
+}
+
+}  // namespace model_scanner
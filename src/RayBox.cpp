@@ -0,0 +1,161 @@
+#include <model_scanner/RayBox.h>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MODEL_SCANNER_X86
+#endif
+
+namespace model_scanner {
+
+namespace {
+
+using IntersectFn = uint32_t (*)(const glm::vec3&, const glm::vec3&,
+                                 const ChildBounds&, float*);
+
+uint32_t intersectScalar(const glm::vec3& origin, const glm::vec3& invDir,
+                         const ChildBounds& b, float* tNear) {
+  uint32_t mask = 0;
+  for (int i = 0; i < 8; ++i) {
+    float t0x = (b.minX[i] - origin.x) * invDir.x;
+    float t1x = (b.maxX[i] - origin.x) * invDir.x;
+    float t0y = (b.minY[i] - origin.y) * invDir.y;
+    float t1y = (b.maxY[i] - origin.y) * invDir.y;
+    float t0z = (b.minZ[i] - origin.z) * invDir.z;
+    float t1z = (b.maxZ[i] - origin.z) * invDir.z;
+    float tmin = std::max(std::max(std::min(t0x, t1x), std::min(t0y, t1y)),
+                          std::min(t0z, t1z));
+    float tmax = std::min(std::min(std::max(t0x, t1x), std::max(t0y, t1y)),
+                          std::max(t0z, t1z));
+    tNear[i] = tmin;
+    mask |= (uint32_t) (tmin <= tmax && tmax > 0.0f) << i;
+  }
+  return mask;
+}
+
+#ifdef MODEL_SCANNER_X86
+uint32_t intersectSse(const glm::vec3& origin, const glm::vec3& invDir,
+                      const ChildBounds& b, float* tNear) {
+  __m128 ox = _mm_set1_ps(origin.x);
+  __m128 oy = _mm_set1_ps(origin.y);
+  __m128 oz = _mm_set1_ps(origin.z);
+  __m128 ix = _mm_set1_ps(invDir.x);
+  __m128 iy = _mm_set1_ps(invDir.y);
+  __m128 iz = _mm_set1_ps(invDir.z);
+  __m128 zero = _mm_setzero_ps();
+
+  uint32_t mask = 0;
+  for (int i = 0; i < 8; i += 4) {
+    __m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b.minX + i), ox), ix);
+    __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b.maxX + i), ox), ix);
+    __m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b.minY + i), oy), iy);
+    __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b.maxY + i), oy), iy);
+    __m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b.minZ + i), oz), iz);
+    __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b.maxZ + i), oz), iz);
+    __m128 tmin = _mm_max_ps(
+        _mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+        _mm_min_ps(t0z, t1z));
+    __m128 tmax = _mm_min_ps(
+        _mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+        _mm_max_ps(t0z, t1z));
+    _mm_storeu_ps(tNear + i, tmin);
+    __m128 hit = _mm_and_ps(_mm_cmple_ps(tmin, tmax), _mm_cmpgt_ps(tmax, zero));
+    mask |= (uint32_t) _mm_movemask_ps(hit) << i;
+  }
+  return mask;
+}
+
+// Subtracts before multiplying like the other paths, as bound * invDir -
+// origin * invDir is inf - inf for a ray parallel to an axis
+__attribute__((target("avx2"))) uint32_t intersectAvx2(
+    const glm::vec3& origin, const glm::vec3& invDir, const ChildBounds& b,
+    float* tNear) {
+  __m256 ox = _mm256_set1_ps(origin.x);
+  __m256 oy = _mm256_set1_ps(origin.y);
+  __m256 oz = _mm256_set1_ps(origin.z);
+  __m256 ix = _mm256_set1_ps(invDir.x);
+  __m256 iy = _mm256_set1_ps(invDir.y);
+  __m256 iz = _mm256_set1_ps(invDir.z);
+
+  __m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b.minX), ox), ix);
+  __m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b.maxX), ox), ix);
+  __m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b.minY), oy), iy);
+  __m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b.maxY), oy), iy);
+  __m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b.minZ), oz), iz);
+  __m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b.maxZ), oz), iz);
+  __m256 tmin = _mm256_max_ps(
+      _mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)),
+      _mm256_min_ps(t0z, t1z));
+  __m256 tmax = _mm256_min_ps(
+      _mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)),
+      _mm256_max_ps(t0z, t1z));
+  _mm256_storeu_ps(tNear, tmin);
+  __m256 hit =
+      _mm256_and_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ),
+                    _mm256_cmp_ps(tmax, _mm256_setzero_ps(), _CMP_GT_OQ));
+  return _mm256_movemask_ps(hit);
+}
+#endif
+
+struct Dispatch {
+  IntersectFn fn;
+  const char* isa;
+
+  Dispatch() : fn(intersectScalar), isa("scalar") {
+#ifdef MODEL_SCANNER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      fn = intersectAvx2;
+      isa = "avx2";
+    } else {
+      fn = intersectSse;
+      isa = "sse";
+    }
+#endif
+  }
+};
+
+const Dispatch& dispatch() {
+  static const Dispatch d;
+  return d;
+}
+
+}  // namespace
+
+ChildBounds ChildBounds::split(const glm::vec3& minPoint,
+                               const glm::vec3& maxPoint) {
+  glm::vec3 mid = 0.5f * (minPoint + maxPoint);
+  ChildBounds bounds;
+  for (int i = 0; i < 8; ++i) {
+    bounds.minX[i] = (i & 1) ? mid.x : minPoint.x;
+    bounds.maxX[i] = (i & 1) ? maxPoint.x : mid.x;
+    bounds.minY[i] = (i & 2) ? mid.y : minPoint.y;
+    bounds.maxY[i] = (i & 2) ? maxPoint.y : mid.y;
+    bounds.minZ[i] = (i & 4) ? mid.z : minPoint.z;
+    bounds.maxZ[i] = (i & 4) ? maxPoint.z : mid.z;
+  }
+  return bounds;
+}
+
+uint32_t intersectChildren(const glm::vec3& origin, const glm::vec3& invDir,
+                           const ChildBounds& bounds, float tNear[8]) {
+  return dispatch().fn(origin, invDir, bounds, tNear);
+}
+
+bool intersectBox(const glm::vec3& origin, const glm::vec3& invDir,
+                  const glm::vec3& minPoint, const glm::vec3& maxPoint,
+                  float& tNear) {
+  glm::vec3 t0 = (minPoint - origin) * invDir;
+  glm::vec3 t1 = (maxPoint - origin) * invDir;
+  glm::vec3 tmin = glm::min(t0, t1);
+  glm::vec3 tmax = glm::max(t0, t1);
+  tNear = std::max(std::max(tmin.x, tmin.y), tmin.z);
+  float tFar = std::min(std::min(tmax.x, tmax.y), tmax.z);
+  return tNear <= tFar && tFar > 0.0f;
+}
+
+const char* intersectChildrenIsa() {
+  return dispatch().isa;
+}
+
+}  // namespace model_scanner
@@ -0,0 +1,890 @@
+#include <model_scanner/Scanner.h>
+#include <model_scanner/CpuCarver.h>
+#include <model_scanner/VoxelCarver.h>
+#include <model_scanner/SurfaceExtractor.h>
+#include <model_scanner/Profiler.h>
+#include <glm/gtc/type_ptr.hpp>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+namespace model_scanner {
+
+Scanner::Scanner(const Options& options)
+  : _camera(options.deviceName, options.calibrationFile),
+    _aprilTagDetector(_camera),
+    _threshold(DEFAULT_THRESHOLD),
+    _octree(glm::vec4(glm::vec3(-SQUARE_SIZE) + OFFSET, 1.0),
+            glm::vec4(glm::vec3(SQUARE_SIZE) + OFFSET, 1.0),
+            options.octreeDepth, options.sparseOctree),
+    _octreeReduction(_octree),
+    _octreeFreeze(_octree),
+    _octreeSync(_octree),
+    _outFileName(options.outFileName),
+    _mergeFaces(options.mergeFaces),
+    _smoothSurface(options.smoothSurface),
+    _checkpointFile(options.checkpointFile),
+    _framesSinceCheckpoint(0),
+    _freezeNodes(options.freezeNodes),
+    _sharded(options.numShards > 1),
+    _keyframes(options.keyframeAngle, options.keyframeDistance,
+               options.keyframeGain),
+    _keyframe(false),
+    _framesSinceRefine(0),
+    _autosaveInterval(options.autosaveInterval),
+    _framesSinceSave(0),
+    _uploadSlot(0),
+    _asyncCapture(options.asyncCapture),
+    _framePolicy(options.framePolicy),
+    _gpuUndistort(options.gpuUndistort),
+    _streamUploads(options.streamUploads),
+    _preview(options.preview),
+    _cameraPreview(options.previewInterval),
+    _fixedPreview(options.previewInterval),
+    _glReady(false) {
+  if (!_checkpointFile.empty())
+    resume();
+  _octree.restrictToShard(options.shard, options.numShards);
+
+  if (options.voxelCarving)
+    _carver = std::make_unique<VoxelCarver>(_octree, options.numThreads);
+  else if (options.cpuCarving)
+    _carver = std::make_unique<CpuCarver>(_octree, options.numThreads);
+
+  // The CPU carvers need the undistorted image in CPU memory
+  if (_gpuUndistort && _carver) {
+    std::cerr << "Warning: Undistorting on the CPU for CPU carving"
+              << std::endl;
+    _gpuUndistort = false;
+  }
+  if (_streamUploads && _carver) {
+    std::cerr << "Warning: Frame streaming is not used with CPU carving"
+              << std::endl;
+    _streamUploads = false;
+  }
+
+  if (options.lumaCapture)
+    _camera.captureLuma();
+
+  AprilTagDetector::TagParams params = { .id = 0, .tagSize = TAG_SIZE };
+  _aprilTagDetector.addTagParams(params);
+  _aprilTagDetector.setTracking(options.tagTracking);
+  _projMatrix = projection(_camera);
+
+  if (options.extraCalibrationFiles.size() > options.extraDeviceNames.size())
+    std::cerr << "Warning: More camera infos than sources, the last ones are "
+              << "not used" << std::endl;
+  for (size_t i = 0; i < options.extraDeviceNames.size(); ++i) {
+    const std::string& deviceName = options.extraDeviceNames[i];
+    std::string calibrationFile = i < options.extraCalibrationFiles.size()
+                                      ? options.extraCalibrationFiles[i]
+                                      : "";
+    Source source;
+    source.camera = std::make_unique<Camera>(deviceName, calibrationFile);
+    if (source.camera->width == 0 || source.camera->height == 0) {
+      std::cerr << "Warning: Unable to open " << deviceName << ", skipping it"
+                << std::endl;
+      continue;
+    }
+    if (options.lumaCapture)
+      source.camera->captureLuma();
+    source.detector = std::make_unique<AprilTagDetector>(*source.camera);
+    source.detector->addTagParams(params);
+    source.detector->setTracking(options.tagTracking);
+    source.projMatrix = projection(*source.camera);
+    source.keyframe = false;
+    _sources.push_back(std::move(source));
+  }
+
+  int scale = std::max(options.previewScale, 1);
+  _previewWidth = std::max(_camera.width / scale, 1);
+  _previewHeight = std::max(_camera.height / scale, 1);
+}
+
+bool Scanner::initGL() {
+  glEnable(GL_DEPTH_TEST);
+
+  glGenTextures(4, _tex);
+  glGenFramebuffers(4, _frameBuffers);
+  glGenRenderbuffers(4, _depthRenderBuffers);
+  for (size_t i = 0; i < 4; ++i) {
+    // Quadrants 1 and 3 hold the previews
+    bool preview = i == 1 || i == 3;
+    initRenderTarget(_tex[i], _frameBuffers[i], _depthRenderBuffers[i],
+                     preview ? _previewWidth : _camera.width,
+                     preview ? _previewHeight : _camera.height);
+  }
+  // The frames of further cameras are carved into targets of their own,
+  // which must not be the textures the frames are sampled from
+  for (Source& source : _sources) {
+    glGenTextures(1, &source.tex);
+    glGenTextures(1, &source.maskTex);
+    glGenFramebuffers(1, &source.frameBuffer);
+    glGenRenderbuffers(1, &source.depthRenderBuffer);
+    initTexture(source.tex, source.camera->width, source.camera->height);
+    initRenderTarget(source.maskTex, source.frameBuffer,
+                     source.depthRenderBuffer, source.camera->width,
+                     source.camera->height);
+  }
+
+  glGenBuffers(1, &_shaderOctreeSsbo);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _shaderOctreeSsbo);
+  _octree.bindData();
+  _octree.bindSubData();
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  _prog = loadProgram("shaders/shader.glsl");
+  if (_prog == 0)
+    return false;
+
+  _shaderMaskModeLoc = glGetUniformLocation(_prog, "maskMode");
+  _shaderTexLoc = glGetUniformLocation(_prog, "image");
+  _shaderScreenSizeLoc = glGetUniformLocation(_prog, "screenSize");
+  _shaderinvProjLoc = glGetUniformLocation(_prog, "invProj");
+  _shaderInvModelViewLoc = glGetUniformLocation(_prog, "invModelView");
+  _shaderThresholdLoc = glGetUniformLocation(_prog, "threshold");
+
+  _compactProg = loadProgram("shaders/compact.glsl", GL_COMPUTE_SHADER);
+  if (_compactProg == 0)
+    return false;
+  _octreeSync.initGL(_compactProg);
+  _reduceProg = loadProgram("shaders/reduce.glsl", GL_COMPUTE_SHADER);
+  if (_reduceProg == 0)
+    return false;
+  _octreeReduction.initGL(_reduceProg);
+  _freezeProg = loadProgram("shaders/freeze.glsl", GL_COMPUTE_SHADER);
+  if (_freezeProg == 0)
+    return false;
+  _octreeFreeze.initGL(_freezeProg);
+
+  if (_gpuUndistort && !initUndistortGL())
+    return false;
+  if (_streamUploads)
+    _streamer.init(3 * _camera.width * _camera.height,
+                   _asyncCapture ? FramePipeline::ringSize() : STREAM_SLOTS);
+  _glReady = true;
+  return true;
+}
+
+// Undistorts the raw frame on the GPU into _tex[0] through a texture that
+// holds the source coordinates of every output pixel, already flipped
+bool Scanner::initUndistortGL() {
+  _undistortProg = loadProgram("shaders/undistort.glsl");
+  if (_undistortProg == 0)
+    return false;
+  _undistortTexLoc = glGetUniformLocation(_undistortProg, "image");
+  _undistortMapLoc = glGetUniformLocation(_undistortProg, "undistortMap");
+  _undistortScreenSizeLoc = glGetUniformLocation(_undistortProg,
+                                                 "screenSize");
+
+  const cv::Mat& mapX = _camera.undistortMapX();
+  const cv::Mat& mapY = _camera.undistortMapY();
+  std::vector<float> map(2 * _camera.width * _camera.height);
+  for (int y = 0; y < _camera.height; ++y) {
+    const float* rowX = mapX.ptr<float>(_camera.height - 1 - y);
+    const float* rowY = mapY.ptr<float>(_camera.height - 1 - y);
+    float* out = &map[2 * y * _camera.width];
+    for (int x = 0; x < _camera.width; ++x) {
+      out[2 * x] = (rowX[x] + 0.5f) / _camera.width;
+      out[2 * x + 1] = (rowY[x] + 0.5f) / _camera.height;
+    }
+  }
+
+  GLuint tex[2];
+  glGenTextures(2, tex);
+  _rawTex = tex[0];
+  _undistortMapTex = tex[1];
+
+  glBindTexture(GL_TEXTURE_2D, _rawTex);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, _camera.width, _camera.height, 0,
+               GL_BGR, GL_UNSIGNED_BYTE, 0);
+
+  glBindTexture(GL_TEXTURE_2D, _undistortMapTex);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, _camera.width, _camera.height, 0,
+               GL_RG, GL_FLOAT, map.data());
+  glBindTexture(GL_TEXTURE_2D, 0);
+  return true;
+}
+
+bool Scanner::render0() {
+  if (_asyncCapture && !_pipeline)
+    startPipeline();
+
+  if (_pipeline) {
+    // The frame uploaded last goes back to the pipeline in next(), so the
+    // GPU has to be done copying it out of its slot
+    if (_streamer.ready())
+      _streamer.wait(_uploadSlot);
+    // Once the source has ended the last frame stays up, without a pose
+    const FramePipeline::Frame* next = _pipeline->next();
+    if (next == nullptr) {
+      _pose = glm::mat4();
+      _keyframe = false;
+      return false;
+    }
+    _frame = next->rgb;
+    _uploadFrame = next->upload;
+    _uploadSlot = next->index;
+    _pose = next->pose;
+    _keyframe = selectKeyframe(_pose, next->grey, next->margin);
+  } else {
+    if (!_camera.read(_rawFrame)) {
+      _pose = glm::mat4();
+      _keyframe = false;
+      return false;
+    }
+    cv::Mat slot;
+    if (_streamer.ready()) {
+      _uploadSlot = (_uploadSlot + 1) % _streamer.size();
+      _streamer.wait(_uploadSlot);
+      slot = cv::Mat(_camera.height, _camera.width, CV_8UC3,
+                     _streamer.slot(_uploadSlot));
+    }
+    if (_camera.capturesLuma()) {
+      // Tags are found in the Y plane, colour is only needed for the texture
+      _greyFrame = _camera.luma(_rawFrame);
+      _aprilTagDetector.setRawGreyFrame(_greyFrame);
+      if (_gpuUndistort) {
+        cv::Mat& bgr = slot.empty() ? _bgrFrame : slot;
+        _camera.toBgr(_rawFrame, bgr);
+        _uploadFrame = bgr;
+      } else {
+        if (!slot.empty())
+          _frame = slot;
+        _camera.toBgr(_rawFrame, _bgrFrame);
+        _camera.undistortRgb(_bgrFrame, _frame);
+        _uploadFrame = _frame;
+      }
+    } else if (_gpuUndistort) {
+      _camera.undistortGrey(_rawFrame, _greyFrame);
+      if (slot.empty())
+        _uploadFrame = _rawFrame;
+      else
+        _rawFrame.copyTo(slot);
+      _aprilTagDetector.setGreyFrame(_greyFrame);
+    } else {
+      if (!slot.empty())
+        _frame = slot;
+      _camera.undistort(_rawFrame, _frame, _greyFrame);
+      _uploadFrame = _frame;
+      _aprilTagDetector.setGreyFrame(_greyFrame);
+    }
+    _pose = _aprilTagDetector.getPose(0);
+    _keyframe =
+        selectKeyframe(_pose, _greyFrame, _aprilTagDetector.getMargin(0));
+  }
+  nextSourceFrames();
+  if (!_glReady)
+    return true;
+
+  GLuint tex = _gpuUndistort ? _rawTex : _tex[0];
+  GLenum format = _gpuUndistort ? GL_BGR : GL_RGB;
+  {
+    PROFILE_SCOPE(UPLOAD);
+    if (_streamer.ready())
+      _streamer.upload(_uploadSlot, tex, _camera.width, _camera.height,
+                       format);
+    else
+      uploadTexture(tex, _uploadFrame, format);
+  }
+  if (!_gpuUndistort)
+    return true;
+
+  PROFILE_GPU_SCOPE(GPU_UNDISTORT);
+  glBindFramebuffer(GL_FRAMEBUFFER, _frameBuffers[0]);
+  glPushMatrix();
+  // The quad is drawn at the same depth every frame
+  glPushAttrib(GL_ENABLE_BIT);
+  glDisable(GL_DEPTH_TEST);
+  glLoadIdentity();
+  gluOrtho2D(0, 1, 0, 1);
+
+  glUseProgram(_undistortProg);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, _undistortMapTex);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, _rawTex);
+  glUniform1i(_undistortTexLoc, 0);
+  glUniform1i(_undistortMapLoc, 1);
+  glUniform2f(_undistortScreenSizeLoc, _camera.width, _camera.height);
+
+  glBegin(GL_QUADS);
+  glVertex2d(0.0, 0.0);
+  glVertex2d(1.0, 0.0);
+  glVertex2d(1.0, 1.0);
+  glVertex2d(0.0, 1.0);
+  glEnd();
+
+  glUseProgram(0);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glPopAttrib();
+  glPopMatrix();
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  return true;
+}
+
+void Scanner::render1() {
+  glm::mat4 modelView = _pose;
+  if (!_preview || modelView == glm::mat4() || !_cameraPreview.due(modelView))
+    return;
+  // Solid inner nodes end the rays early
+  reduceOctree();
+
+  glBindFramebuffer(GL_FRAMEBUFFER, _frameBuffers[1]);
+  glPushMatrix();
+  glPushAttrib(GL_VIEWPORT_BIT);
+  glViewport(0, 0, _previewWidth, _previewHeight);
+
+  {
+    PROFILE_GPU_SCOPE(GPU_RENDER);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    gluOrtho2D(0, 1, 0, 1);
+
+    glm::mat4 invProj = glm::inverse(_projMatrix);
+    glm::mat4 invModelView = glm::inverse(modelView);
+
+    glUseProgram(_prog);
+    glBindTexture(GL_TEXTURE_2D, _tex[0]);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _shaderOctreeSsbo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, _shaderOctreeSsbo);
+    glUniform1ui(_shaderMaskModeLoc, 0);
+    glUniform1ui(_shaderTexLoc, 0);
+    glUniform2f(_shaderScreenSizeLoc, _previewWidth, _previewHeight);
+    glUniformMatrix4fv(_shaderinvProjLoc, 1, GL_FALSE, glm::value_ptr(invProj));
+    glUniformMatrix4fv(_shaderInvModelViewLoc, 1, GL_FALSE,
+                       glm::value_ptr(invModelView));
+    glUniform1f(_shaderThresholdLoc, _threshold);
+
+    glBegin(GL_QUADS);
+    glVertex2d(0.0, 0.0);
+    glVertex2d(1.0, 0.0);
+    glVertex2d(1.0, 1.0);
+    glVertex2d(0.0, 1.0);
+    glEnd();
+
+    glUseProgram(0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  }
+
+  glPopAttrib();
+  glPopMatrix();
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void Scanner::render2() {
+  std::vector<Carver::View> views;
+  if (_keyframe)
+    views.push_back({ &_frame, _projMatrix, _pose });
+  for (const Source& source : _sources)
+    if (source.keyframe)
+      views.push_back({ &source.frame, source.projMatrix, source.pose });
+
+  if (_carver) {
+    if (!views.empty()) {
+      {
+        PROFILE_SCOPE(CARVE);
+        _carver->carve(views);
+      }
+      carved();
+      refineOctree();
+      uploadOctree();
+      autosave();
+      checkpoint();
+    }
+    return;
+  }
+
+  glBindFramebuffer(GL_FRAMEBUFFER, _frameBuffers[2]);
+
+  glPushMatrix();
+  glPushAttrib(GL_ENABLE_BIT);
+
+  glLoadIdentity();
+  gluOrtho2D(0, 1, 0, 1);
+
+  glDisable(GL_DEPTH_TEST);
+
+  glBegin(GL_QUADS);
+  glColor3f(0.0, 0.0, 0.0);
+  glTexCoord2d(0.0, 0.0);
+  glVertex2d(0.0, 0.0);
+  glTexCoord2d(1.0, 0.0);
+  glVertex2d(1.0, 0.0);
+  glTexCoord2d(1.0, 1.0);
+  glVertex2d(1.0, 1.0);
+  glTexCoord2d(0.0, 1.0);
+  glVertex2d(0.0, 1.0);
+  glEnd();
+
+  glPopAttrib();
+  if (!views.empty()) {
+    // All cameras of the frame set are carved back to back
+    {
+      PROFILE_GPU_SCOPE(GPU_CARVE);
+      if (_keyframe)
+        carveGPU(_tex[0], _projMatrix, _pose, _camera.width, _camera.height);
+      for (const Source& source : _sources) {
+        if (!source.keyframe)
+          continue;
+        glBindFramebuffer(GL_FRAMEBUFFER, source.frameBuffer);
+        glPushAttrib(GL_VIEWPORT_BIT);
+        glViewport(0, 0, source.camera->width, source.camera->height);
+        carveGPU(source.tex, source.projMatrix, source.pose,
+                 source.camera->width, source.camera->height);
+        glPopAttrib();
+      }
+      glBindFramebuffer(GL_FRAMEBUFFER, _frameBuffers[2]);
+    }
+
+    carved();
+    refineOctree();
+    autosave();
+    checkpoint();
+  }
+
+  glPopMatrix();
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Draws the bottom face of the octree's bounds in mask mode, which counts
+// every ray of the frame through it in the octree. Expects the projection
+// matrix to be current and leaves it that way.
+void Scanner::carveGPU(GLuint tex, const glm::mat4& projMatrix,
+                       const glm::mat4& modelView, int width, int height) {
+  glClear(GL_DEPTH_BUFFER_BIT);
+  glLoadMatrixf(glm::value_ptr(projMatrix));
+  glMatrixMode(GL_MODELVIEW);
+  glLoadMatrixf(glm::value_ptr(modelView));
+
+  glm::mat4 invProj = glm::inverse(projMatrix);
+  glm::mat4 invModelView = glm::inverse(modelView);
+
+  glUseProgram(_prog);
+  glBindTexture(GL_TEXTURE_2D, tex);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _shaderOctreeSsbo);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, _shaderOctreeSsbo);
+  glUniform1ui(_shaderMaskModeLoc, 1);
+  glUniform1ui(_shaderTexLoc, 0);
+  glUniform2f(_shaderScreenSizeLoc, width, height);
+  glUniformMatrix4fv(_shaderinvProjLoc, 1, GL_FALSE, glm::value_ptr(invProj));
+  glUniformMatrix4fv(_shaderInvModelViewLoc, 1, GL_FALSE,
+                     glm::value_ptr(invModelView));
+  glUniform1f(_shaderThresholdLoc, _threshold);
+
+  glBegin(GL_QUADS);
+  glVertex3d(OFFSET.x - SQUARE_SIZE, OFFSET.y - SQUARE_SIZE, 0);
+  glVertex3d(OFFSET.x - SQUARE_SIZE, OFFSET.y + SQUARE_SIZE, 0);
+  glVertex3d(OFFSET.x + SQUARE_SIZE, OFFSET.y + SQUARE_SIZE, 0);
+  glVertex3d(OFFSET.x + SQUARE_SIZE, OFFSET.y - SQUARE_SIZE, 0);
+  glEnd();
+
+  glUseProgram(0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+  glLoadIdentity();
+  glMatrixMode(GL_PROJECTION);
+}
+
+void Scanner::render3() {
+  if (!_preview || !_fixedPreview.due(glm::mat4(1.0)))
+    return;
+  reduceOctree();
+
+  PROFILE_GPU_SCOPE(GPU_PREVIEW);
+  glBindFramebuffer(GL_FRAMEBUFFER, _frameBuffers[3]);
+  glPushMatrix();
+  glPushAttrib(GL_VIEWPORT_BIT);
+  glViewport(0, 0, _previewWidth, _previewHeight);
+
+  glClear(GL_DEPTH_BUFFER_BIT);
+  gluOrtho2D(0, 1, 0, 1);
+
+  glm::mat4 invProj = glm::inverse(_projMatrix);
+  glm::mat4 invModelView = glm::inverse(glm::lookAt(
+      glm::vec3(0.1, 0.1, 0.1) + OFFSET, OFFSET, glm::vec3(0, 0, 1)));
+
+  glUseProgram(_prog);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _shaderOctreeSsbo);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, _shaderOctreeSsbo);
+  glUniform1ui(_shaderMaskModeLoc, 0);
+  glUniform1ui(_shaderTexLoc, 0);
+  glUniform2f(_shaderScreenSizeLoc, _previewWidth, _previewHeight);
+  glUniformMatrix4fv(_shaderinvProjLoc, 1, GL_FALSE, glm::value_ptr(invProj));
+  glUniformMatrix4fv(_shaderInvModelViewLoc, 1, GL_FALSE,
+                     glm::value_ptr(invModelView));
+  glUniform1f(_shaderThresholdLoc, _threshold);
+
+  glBegin(GL_QUADS);
+  glVertex2d(0.0, 0.0);
+  glVertex2d(1.0, 0.0);
+  glVertex2d(1.0, 1.0);
+  glVertex2d(0.0, 1.0);
+  glEnd();
+
+  glUseProgram(0);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+  glPopAttrib();
+  glPopMatrix();
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void Scanner::writeModel() {
+  std::cout << "Writing " << (_sharded ? _checkpointFile : _outFileName)
+            << "...";
+  if (_carver) {
+    _carver->flush();
+  } else if (_smoothSurface || !_checkpointFile.empty()) {
+    // The surface goes through the ratios and checkpoints keep the counters
+    readOctree();
+  } else {
+    reduceOctree();
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _shaderOctreeSsbo);
+    _octreeSync.start(_shaderOctreeSsbo, _threshold);
+    _octreeSync.wait();
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  }
+  saveModel();
+  if (!_checkpointFile.empty())
+    _octree.save(_checkpointFile);
+  std::cout << " Done!" << std::endl;
+}
+
+void Scanner::clear() {
+  if (_carver)
+    _carver->flush();
+  _octree.clear();
+  _keyframes.clear();
+  uploadOctree();
+  _cameraPreview.invalidate();
+  _fixedPreview.invalidate();
+}
+
+// The pipeline writes into the streamer's slots, so it is stopped before
+// they are unmapped
+void Scanner::releaseGL() {
+  _pipeline.reset();
+  _streamer.release();
+  _octreeSync.release();
+}
+
+const Camera& Scanner::camera() const {
+  return _camera;
+}
+
+const KeyframeSelector& Scanner::keyframes() const {
+  return _keyframes;
+}
+
+GLuint Scanner::texture(size_t idx) const {
+  return _tex[idx];
+}
+
+void Scanner::startPipeline() {
+  uint8_t* storage = _streamer.ready() ? _streamer.slot(0) : nullptr;
+  _pipeline = std::make_unique<FramePipeline>(
+      _camera, _aprilTagDetector, _framePolicy, _gpuUndistort, storage,
+      _streamer.slotSize());
+}
+
+// Takes the latest frame of every further camera. A camera whose source has
+// ended stops carving.
+void Scanner::nextSourceFrames() {
+  for (Source& source : _sources) {
+    if (!source.pipeline)
+      source.pipeline = std::make_unique<FramePipeline>(
+          *source.camera, *source.detector, _framePolicy);
+    const FramePipeline::Frame* next = source.pipeline->next();
+    if (next == nullptr) {
+      source.pose = glm::mat4();
+      source.keyframe = false;
+      continue;
+    }
+    source.frame = next->rgb;
+    source.pose = next->pose;
+    source.keyframe = selectKeyframe(source.pose, next->grey, next->margin);
+    if (_glReady && !_carver) {
+      PROFILE_SCOPE(UPLOAD);
+      uploadTexture(source.tex, source.frame, GL_RGB);
+    }
+  }
+}
+
+// All cameras share the keyframes, a view one of them already carved is not
+// carved again from another
+bool Scanner::selectKeyframe(const glm::mat4& pose, const cv::Mat& grey,
+                             float margin) {
+  return pose != glm::mat4() && _keyframes.select(pose, grey, margin);
+}
+
+void Scanner::refineOctree() {
+  if ((!_octree.isSparse() && !_freezeNodes) ||
+      ++_framesSinceRefine < REFINE_INTERVAL)
+    return;
+  _framesSinceRefine = 0;
+  if (_carver) {
+    _carver->flush();
+    _octree.refine(_threshold, _carver->refineMinSamples());
+    if (_freezeNodes)
+      _octree.freeze(_threshold, _carver->refineMinSamples());
+    return;
+  }
+
+  reduceOctree();
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _shaderOctreeSsbo);
+  // Dense trees are only frozen, which needs no readback
+  if (!_octree.isSparse()) {
+    _octreeFreeze.run(_shaderOctreeSsbo, _threshold);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return;
+  }
+  {
+    PROFILE_SCOPE(READBACK);
+    PROFILE_GPU_SCOPE(GPU_READBACK);
+    _octree.update();
+  }
+  _octree.refine(_threshold);
+  if (_freezeNodes)
+    _octree.freeze(_threshold);
+  _octree.bindSubData();
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  _octreeReduction.invalidate();
+  resetSync();
+}
+
+void Scanner::uploadOctree() {
+  if (!_glReady)
+    return;
+  if (_carver)
+    _carver->flush();
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _shaderOctreeSsbo);
+  _octree.bindSubData();
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  if (!_carver) {
+    _octreeReduction.invalidate();
+    resetSync();
+  }
+}
+
+// The GPU path only starts a sync here and writes the model once it has
+// come back, so carving never waits on the readback
+void Scanner::autosave() {
+  if (_autosaveInterval == 0)
+    return;
+  if (_octreeSync.poll())
+    saveModel();
+  if (++_framesSinceSave < _autosaveInterval || _octreeSync.pending())
+    return;
+  _framesSinceSave = 0;
+
+  if (_carver) {
+    _carver->flush();
+    saveModel();
+    return;
+  }
+  // The surface goes through the ratios, which the sync does not keep
+  if (_smoothSurface) {
+    readOctree();
+    saveModel();
+    return;
+  }
+  reduceOctree();
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _shaderOctreeSsbo);
+  _octreeSync.start(_shaderOctreeSsbo, _threshold);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void Scanner::saveModel() {
+  // The other shards' parts are missing until they are stitched together
+  if (_sharded)
+    return;
+  if (_smoothSurface)
+    SurfaceExtractor(_octree).write(_outFileName, _threshold);
+  else
+    _octree.write(_outFileName, _threshold, _mergeFaces);
+}
+
+void Scanner::resume() {
+  if (!std::filesystem::exists(_checkpointFile))
+    return;
+  Octree saved;
+  if (!saved.load(_checkpointFile))
+    return;
+  if (!saved.sameVolume(_octree)) {
+    std::cerr << "Warning: " << _checkpointFile << " has a different depth "
+              << "or bounds, starting over" << std::endl;
+    return;
+  }
+  _octree = std::move(saved);
+  std::cout << "Resuming from " << _checkpointFile << std::endl;
+}
+
+void Scanner::checkpoint() {
+  if (_checkpointFile.empty() ||
+      ++_framesSinceCheckpoint < CHECKPOINT_INTERVAL)
+    return;
+  _framesSinceCheckpoint = 0;
+  if (_carver)
+    _carver->flush();
+  else
+    readOctree();
+  _octree.save(_checkpointFile);
+}
+
+void Scanner::carved() {
+  _cameraPreview.carved();
+  _fixedPreview.carved();
+  _octreeReduction.invalidate();
+}
+
+// Reads back all counters, which leaves nothing for the next sync to go by
+void Scanner::readOctree() {
+  reduceOctree();
+  PROFILE_SCOPE(READBACK);
+  PROFILE_GPU_SCOPE(GPU_READBACK);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _shaderOctreeSsbo);
+  _octree.update();
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  resetSync();
+}
+
+// An autosave whose sync is dropped starts again with the next frame
+void Scanner::resetSync() {
+  if (_octreeSync.reset())
+    _framesSinceSave = _autosaveInterval;
+}
+
+void Scanner::reduceOctree() {
+  if (_carver)
+    return;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _shaderOctreeSsbo);
+  _octreeReduction.run(_shaderOctreeSsbo);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+glm::mat4 Scanner::projection(const Camera& camera) {
+  double fx = camera.calibration.k.at<double>(0, 0);
+  double fy = camera.calibration.k.at<double>(1, 1);
+  double cx = camera.calibration.k.at<double>(0, 2);
+  double cy = camera.calibration.k.at<double>(1, 2);
+  double zfar = 10.0;
+  double znear = 0.01;
+
+  glm::mat4 projMatrix;
+  projMatrix[0][0] = 2.0 * fx / camera.width;
+  projMatrix[0][1] = 0.0;
+  projMatrix[0][2] = 0.0;
+  projMatrix[0][3] = 0.0;
+
+  projMatrix[1][0] = 0.0;
+  projMatrix[1][1] = 2.0 * fy / camera.height;
+  projMatrix[1][2] = 0.0;
+  projMatrix[1][3] = 0.0;
+
+  projMatrix[2][0] = 1.0 - 2.0 * cx / camera.width;
+  projMatrix[2][1] = 2.0 * cy / camera.height - 1.0;
+  projMatrix[2][2] = -(zfar + znear) / (zfar - znear);
+  projMatrix[2][3] = -1.0;
+
+  projMatrix[3][0] = 0.0;
+  projMatrix[3][1] = 0.0;
+  projMatrix[3][2] = -2.0 * znear * zfar / (zfar - znear);
+  projMatrix[3][3] = 0.0;
+  return projMatrix;
+}
+
+void Scanner::initRenderTarget(GLuint tex, GLuint frameBuffer,
+                               GLuint depthRenderBuffer, int width,
+                               int height) {
+  initTexture(tex, width, height);
+  glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
+  glBindRenderbuffer(GL_RENDERBUFFER, depthRenderBuffer);
+
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, width, height);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                            GL_RENDERBUFFER, depthRenderBuffer);
+
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tex, 0);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+}
+
+void Scanner::initTexture(GLuint tex, int width, int height) {
+  glBindTexture(GL_TEXTURE_2D, tex);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+  glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
+
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB,
+               GL_UNSIGNED_BYTE, 0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void Scanner::uploadTexture(GLuint tex, const cv::Mat& image, GLenum format) {
+  glBindTexture(GL_TEXTURE_2D, tex);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, (image.step & 0b11) ? 1 : 4);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, image.step / image.elemSize());
+
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image.cols, image.rows, format,
+                  GL_UNSIGNED_BYTE, image.data);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+GLuint Scanner::loadProgram(const std::string& filename, GLenum type) {
+  GLint status;
+
+  std::string shaderStr = loadFile(filename);
+  const char* shaderSrc = shaderStr.c_str();
+  GLuint shader = glCreateShader(type);
+  glShaderSource(shader, 1, &shaderSrc, nullptr);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+  if (status != GL_TRUE) {
+    char buffer[512];
+    glGetShaderInfoLog(shader, 512, nullptr, buffer);
+    std::cerr << "Error compiling shader: " << std::endl << buffer << std::endl;
+    return 0;
+  }
+
+  GLuint prog = glCreateProgram();
+  glAttachShader(prog, shader);
+  glLinkProgram(prog);
+  glGetProgramiv(prog, GL_LINK_STATUS, &status);
+  if (status != GL_TRUE) {
+    char buffer[512];
+    glGetProgramInfoLog(prog, 512, nullptr, buffer);
+    std::cerr << "Error linking shader: " << std::endl << buffer << std::endl;
+    return 0;
+  }
+
+  glDeleteShader(shader);
+  return prog;
+}
+
+std::string Scanner::loadFile(const std::string& filename) {
+  std::ifstream shaderFile(filename);
+  std::stringstream shaderSrc;
+  shaderSrc << shaderFile.rdbuf();
+  return shaderSrc.str();
+}
+
+}  // namespace model_scanner
@@ -0,0 +1,118 @@
+#include <model_scanner/ShardCoordinator.h>
+#include <model_scanner/SurfaceExtractor.h>
+#include <filesystem>
+#include <iostream>
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace model_scanner {
+
+ShardCoordinator::ShardCoordinator(const Scanner::Options& options,
+                                   size_t numShards,
+                                   const std::vector<std::string>& args)
+  : _options(options), _numShards(numShards), _args(args) {}
+
+int ShardCoordinator::run() {
+  // Workers resume from their checkpoints, stale ones would be counted twice
+  for (size_t i = 0; i < _numShards; ++i)
+    std::filesystem::remove(shardFile(i));
+
+  std::vector<pid_t> workers;
+  for (size_t i = 0; i < _numShards; ++i) {
+    pid_t pid = spawn(i);
+    if (pid < 0) {
+      std::cerr << "Error: Unable to start worker " << i << std::endl;
+      break;
+    }
+    workers.push_back(pid);
+  }
+
+  bool ok = workers.size() == _numShards;
+  for (size_t i = 0; i < workers.size(); ++i) {
+    int status;
+    if (waitpid(workers[i], &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      std::cerr << "Error: Worker " << i << " failed" << std::endl;
+      ok = false;
+    }
+  }
+  if (!ok)
+    return 1;
+
+  Octree octree;
+  if (!stitch(octree))
+    return 1;
+  std::cout << "Writing model to " << _options.outFileName << "...";
+  if (_options.smoothSurface)
+    SurfaceExtractor(octree).write(_options.outFileName,
+                                   Scanner::DEFAULT_THRESHOLD);
+  else
+    octree.write(_options.outFileName, Scanner::DEFAULT_THRESHOLD,
+                 _options.mergeFaces);
+  if (!_options.checkpointFile.empty())
+    octree.save(_options.checkpointFile);
+  std::cout << " Done!" << std::endl;
+
+  for (size_t i = 0; i < _numShards; ++i)
+    std::filesystem::remove(shardFile(i));
+  return 0;
+}
+
+// Every worker gets a contiguous share of the CPUs this process may run on,
+// which keeps it, and the memory it touches first, on as few NUMA nodes as
+// possible
+pid_t ShardCoordinator::spawn(size_t shard) const {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  std::vector<int> cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    if (CPU_ISSET(cpu, &allowed))
+      cpus.push_back(cpu);
+  size_t first = shard * cpus.size() / _numShards;
+  size_t last = std::max((shard + 1) * cpus.size() / _numShards, first + 1);
+  cpu_set_t own;
+  CPU_ZERO(&own);
+  for (size_t i = first; i < last; ++i)
+    CPU_SET(cpus[i % cpus.size()], &own);
+
+  std::vector<std::string> args = _args;
+  args.insert(args.end(), { "--shard",
+                            std::to_string(shard) + "/" +
+                                std::to_string(_numShards),
+                            "--checkpoint", shardFile(shard), "--batch" });
+  if (_options.numThreads == 0)
+    args.insert(args.end(), { "--threads", std::to_string(last - first) });
+
+  pid_t pid = fork();
+  if (pid != 0)
+    return pid;
+  sched_setaffinity(0, sizeof(own), &own);
+  std::vector<char*> argv;
+  for (std::string& arg : args)
+    argv.push_back(arg.data());
+  argv.push_back(nullptr);
+  execv("/proc/self/exe", argv.data());
+  std::cerr << "Error: Unable to run worker " << shard << std::endl;
+  _exit(127);
+}
+
+bool ShardCoordinator::stitch(Octree& octree) const {
+  if (!octree.load(shardFile(0)))
+    return false;
+  for (size_t i = 1; i < _numShards; ++i) {
+    Octree shard;
+    if (!shard.load(shardFile(i)) || !octree.stitch(shard, i, _numShards))
+      return false;
+  }
+  return true;
+}
+
+std::string ShardCoordinator::shardFile(size_t shard) const {
+  std::filesystem::path path(_options.outFileName);
+  path.replace_extension(".shard" + std::to_string(shard) + ".oct");
+  return path.string();
+}
+
+}  // namespace model_scanner
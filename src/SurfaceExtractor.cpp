@@ -0,0 +1,185 @@
+#include <model_scanner/SurfaceExtractor.h>
+#include <model_scanner/MeshWriter.h>
+#include <algorithm>
+
+namespace model_scanner {
+
+SurfaceExtractor::SurfaceExtractor(const Octree& octree, size_t numThreads)
+  : _octree(octree), _pool(numThreads), _size(1 << octree._header.depth) {
+  glm::vec3 rootSize = glm::vec3(_octree._header.maxPoint) -
+                       glm::vec3(_octree._header.minPoint);
+  // Written relative to the middle of the octree, with samples in the
+  // middle of the cells of the finest level
+  _cellSize = rootSize / (float) _size;
+  _origin = -0.5f * rootSize + 0.5f * _cellSize;
+}
+
+bool SurfaceExtractor::write(const std::string& filename, float threshold) {
+  // Cell layers go from -1 to _size - 1
+  size_t numLayers = _size + 1;
+  size_t numSlabs = std::min(numLayers, SLABS_PER_THREAD * _pool.size());
+  std::vector<Slab> slabs(numSlabs);
+  for (size_t s = 0; s < numSlabs; ++s) {
+    slabs[s].begin = -1 + numLayers * s / numSlabs;
+    slabs[s].end = -1 + numLayers * (s + 1) / numSlabs;
+  }
+  _pool.parallelFor(numSlabs, [&](size_t s, size_t) {
+    extractSlab(slabs[s], threshold);
+  });
+
+  std::vector<size_t> vertexOffsets(numSlabs + 1, 0);
+  std::vector<size_t> triangleOffsets(numSlabs + 1, 0);
+  for (size_t s = 0; s < numSlabs; ++s) {
+    vertexOffsets[s + 1] = vertexOffsets[s] + slabs[s].vertices.size();
+    triangleOffsets[s + 1] = triangleOffsets[s] + slabs[s].triangles.size();
+  }
+
+  std::vector<glm::vec3> vertices(vertexOffsets.back());
+  std::vector<uint32_t> triangles(triangleOffsets.back());
+  _pool.parallelFor(numSlabs, [&](size_t s, size_t) {
+    const Slab& slab = slabs[s];
+    std::copy(slab.vertices.begin(), slab.vertices.end(),
+              vertices.begin() + vertexOffsets[s]);
+    uint32_t* out = &triangles[triangleOffsets[s]];
+    for (uint32_t idx : slab.triangles) {
+      if (idx & PREVIOUS_SLAB)
+        *out++ = vertexOffsets[s - 1] +
+                 slabs[s - 1].lastLayer[idx & ~PREVIOUS_SLAB];
+      else
+        *out++ = vertexOffsets[s] + idx;
+    }
+  });
+
+  MeshWriter writer(_pool);
+  return writer.write(filename, vertices, triangles);
+}
+
+// Walks the cell layers of the slab keeping only the samples below and
+// above the current layer and the vertices of the current and last layer
+void SurfaceExtractor::extractSlab(Slab& slab, float threshold) const {
+  int32_t width = _size + 2;
+  int32_t cellWidth = _size + 1;
+  std::vector<float> below(width * width);
+  std::vector<float> above(width * width);
+  std::vector<int32_t> lastCells(cellWidth * cellWidth, -1);
+  std::vector<int32_t> cells(cellWidth * cellWidth, -1);
+
+  // Samples and cells both start at -1
+  auto at = [&](const std::vector<float>& layer, int32_t x, int32_t y) {
+    return layer[(y + 1) * width + x + 1];
+  };
+  auto cellIdx = [&](int32_t x, int32_t y) {
+    return (y + 1) * cellWidth + x + 1;
+  };
+
+  sampleLayer(slab.begin, threshold, below);
+  for (int32_t z = slab.begin; z < slab.end; ++z) {
+    sampleLayer(z + 1, threshold, above);
+
+    for (int32_t y = -1; y < _size; ++y) {
+      for (int32_t x = -1; x < _size; ++x) {
+        float values[8];
+        int inside = 0;
+        for (int c = 0; c < 8; ++c) {
+          values[c] = at(c & 4 ? above : below, x + (c & 1),
+                         y + ((c >> 1) & 1));
+          inside += values[c] >= 0.0f;
+        }
+        if (inside == 0 || inside == 8)
+          continue;
+
+        glm::vec3 sum(0.0f);
+        int crossings = 0;
+        for (int bit = 1; bit < 8; bit <<= 1) {
+          for (int c = 0; c < 8; ++c) {
+            if ((c & bit) || (values[c] >= 0.0f) == (values[c | bit] >= 0.0f))
+              continue;
+            float t = values[c] / (values[c] - values[c | bit]);
+            glm::vec3 corner(c & 1, (c >> 1) & 1, (c >> 2) & 1);
+            glm::vec3 step(bit == 1, bit == 2, bit == 4);
+            sum += corner + t * step;
+            ++crossings;
+          }
+        }
+        glm::vec3 pos = glm::vec3(x, y, z) + sum / (float) crossings;
+        cells[cellIdx(x, y)] = slab.vertices.size();
+        slab.vertices.push_back(_origin + pos * _cellSize);
+      }
+    }
+
+    // Cells of the layer below the slab are left to the slab before
+    auto vertex = [&](int32_t x, int32_t y, bool last) -> uint32_t {
+      if (!last)
+        return cells[cellIdx(x, y)];
+      if (z == slab.begin)
+        return PREVIOUS_SLAB | cellIdx(x, y);
+      return lastCells[cellIdx(x, y)];
+    };
+    // The quad around an edge from a sample inside, winding
+    // counterclockwise seen from the outside
+    auto quad = [&](uint32_t q0, uint32_t q1, uint32_t q2, uint32_t q3,
+                    bool flip) {
+      if (flip)
+        std::swap(q1, q3);
+      slab.triangles.insert(slab.triangles.end(), { q0, q1, q2, q0, q2, q3 });
+    };
+
+    for (int32_t y = -1; y < _size; ++y) {
+      for (int32_t x = -1; x < _size; ++x) {
+        bool inside = at(below, x, y) >= 0.0f;
+        // Along z, between the cells around it in this layer
+        if (x >= 0 && y >= 0 && inside != (at(above, x, y) >= 0.0f))
+          quad(vertex(x, y, false), vertex(x - 1, y, false),
+               vertex(x - 1, y - 1, false), vertex(x, y - 1, false), !inside);
+        if (z < 0)
+          continue;
+        // Along x and y, between this layer and the last
+        if (y >= 0 && x < _size && inside != (at(below, x + 1, y) >= 0.0f))
+          quad(vertex(x, y, false), vertex(x, y - 1, false),
+               vertex(x, y - 1, true), vertex(x, y, true), !inside);
+        if (x >= 0 && y < _size && inside != (at(below, x, y + 1) >= 0.0f))
+          quad(vertex(x, y, false), vertex(x, y, true),
+               vertex(x - 1, y, true), vertex(x - 1, y, false), !inside);
+      }
+    }
+
+    std::swap(below, above);
+    std::swap(lastCells, cells);
+    std::fill(cells.begin(), cells.end(), -1);
+  }
+  slab.lastLayer = std::move(lastCells);
+}
+
+// The ratio minus the threshold, so the surface is where it is 0
+void SurfaceExtractor::sampleLayer(int32_t z, float threshold,
+                                   std::vector<float>& layer) const {
+  int32_t width = _size + 2;
+  for (int32_t y = -1; y <= _size; ++y)
+    for (int32_t x = -1; x <= _size; ++x)
+      layer[(y + 1) * width + x + 1] = sample(x, y, z) - threshold;
+}
+
+// The ratio of the deepest node the sample is in, or of the frozen node it
+// is in, 0 outside the octree
+float SurfaceExtractor::sample(int32_t x, int32_t y, int32_t z) const {
+  if (x < 0 || y < 0 || z < 0 || x >= _size || y >= _size || z >= _size)
+    return 0.0f;
+  int depth = _octree._header.depth;
+  size_t current = 0;
+  for (int level = 0; level < depth; ++level) {
+    size_t children = _octree.firstChild(current, level);
+    if (children == 0 || _octree.isFrozen(current))
+      break;
+    int shift = depth - 1 - level;
+    size_t octant = ((x >> shift) & 1) | ((y >> shift) & 1) << 1 |
+                    ((z >> shift) & 1) << 2;
+    current = children + octant;
+  }
+  // Restored, stitched or frozen counters can add up to nothing
+  uint32_t total = _octree.total(current);
+  if (total == 0)
+    return 0.0;
+  return (float) _octree._hits[current] / total;
+}
+
+}  // namespace model_scanner
@@ -0,0 +1,92 @@
+#include <model_scanner/TextureStreamer.h>
+#include <iostream>
+
+namespace model_scanner {
+
+TextureStreamer::TextureStreamer() : _pbo(0), _data(nullptr), _slotSize(0) {}
+
+bool TextureStreamer::init(size_t slotSize, size_t numSlots) {
+  if (!GLEW_ARB_buffer_storage) {
+    std::cerr << "Warning: GL_ARB_buffer_storage is not supported, "
+              << "uploading frames directly" << std::endl;
+    return false;
+  }
+
+  // Cache line aligned so that writers of neighbouring slots never share one
+  _slotSize = (slotSize + 63) & ~size_t(63);
+  GLbitfield flags =
+      GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  glGenBuffers(1, &_pbo);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _pbo);
+  glBufferStorage(GL_PIXEL_UNPACK_BUFFER, _slotSize * numSlots, nullptr,
+                  flags);
+  _data = (uint8_t*) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+                                      _slotSize * numSlots, flags);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  if (_data == nullptr) {
+    std::cerr << "Warning: Unable to map the frame upload buffer, "
+              << "uploading frames directly" << std::endl;
+    glDeleteBuffers(1, &_pbo);
+    _pbo = 0;
+    return false;
+  }
+  _fences.assign(numSlots, nullptr);
+  return true;
+}
+
+bool TextureStreamer::ready() const {
+  return _data != nullptr;
+}
+
+size_t TextureStreamer::size() const {
+  return _fences.size();
+}
+
+size_t TextureStreamer::slotSize() const {
+  return _slotSize;
+}
+
+uint8_t* TextureStreamer::slot(size_t idx) const {
+  return _data + idx * _slotSize;
+}
+
+void TextureStreamer::wait(size_t idx) {
+  GLsync& fence = _fences[idx];
+  if (fence == nullptr)
+    return;
+  GLenum result;
+  do {
+    result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+  } while (result == GL_TIMEOUT_EXPIRED);
+  glDeleteSync(fence);
+  fence = nullptr;
+}
+
+void TextureStreamer::release() {
+  if (_pbo == 0)
+    return;
+  for (size_t i = 0; i < _fences.size(); ++i)
+    wait(i);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _pbo);
+  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  glDeleteBuffers(1, &_pbo);
+  _pbo = 0;
+  _data = nullptr;
+  _fences.clear();
+}
+
+void TextureStreamer::upload(size_t idx, GLuint tex, int width, int height,
+                             GLenum format) {
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _pbo);
+  glBindTexture(GL_TEXTURE_2D, tex);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format,
+                  GL_UNSIGNED_BYTE, (void*) (idx * _slotSize));
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  _fences[idx] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+}  // namespace model_scanner
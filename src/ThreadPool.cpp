@@ -0,0 +1,106 @@
+#include <model_scanner/ThreadPool.h>
+
+namespace model_scanner {
+
+ThreadPool::ThreadPool(size_t numThreads)
+  : _task(nullptr), _generation(0), _remaining(0), _active(0), _stop(false) {
+  if (numThreads == 0)
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t i = 0; i < numThreads; ++i)
+    _queues.push_back(std::make_unique<Queue>());
+  for (size_t i = 0; i < numThreads; ++i)
+    _threads.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _start.notify_all();
+  for (auto& thread : _threads)
+    thread.join();
+}
+
+size_t ThreadPool::size() const {
+  return _threads.size();
+}
+
+void ThreadPool::parallelFor(size_t count, const Task& task) {
+  if (count == 0)
+    return;
+
+  // Deal indices out in contiguous runs so neighbouring tiles share a worker
+  // until someone runs dry and starts stealing from the far end
+  size_t perQueue = (count + _queues.size() - 1) / _queues.size();
+  for (size_t i = 0; i < _queues.size(); ++i) {
+    std::lock_guard<std::mutex> lock(_queues[i]->mutex);
+    for (size_t idx = i * perQueue; idx < std::min(count, (i + 1) * perQueue);
+         ++idx)
+      _queues[i]->indices.push_back(idx);
+  }
+
+  std::unique_lock<std::mutex> lock(_mutex);
+  _task = &task;
+  _remaining = count;
+  ++_generation;
+  _start.notify_all();
+  _done.wait(lock, [this] { return _remaining == 0 && _active == 0; });
+  _task = nullptr;
+}
+
+void ThreadPool::workerLoop(size_t worker) {
+  size_t seenGeneration = 0;
+  while (true) {
+    const Task* task;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _start.wait(lock,
+                  [&] { return _stop || _generation != seenGeneration; });
+      if (_stop)
+        return;
+      seenGeneration = _generation;
+      task = _task;
+      if (task == nullptr)
+        continue;
+      ++_active;
+    }
+
+    size_t idx;
+    while (pop(worker, idx) || steal(worker, idx)) {
+      (*task)(idx, worker);
+      --_remaining;
+    }
+
+    // parallelFor only returns once every worker has left the loop above, so
+    // no one can pick up the next call's indices with a stale task
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (--_active == 0)
+      _done.notify_all();
+  }
+}
+
+bool ThreadPool::pop(size_t worker, size_t& idx) {
+  Queue& queue = *_queues[worker];
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.indices.empty())
+    return false;
+  idx = queue.indices.front();
+  queue.indices.pop_front();
+  return true;
+}
+
+bool ThreadPool::steal(size_t worker, size_t& idx) {
+  for (size_t i = 1; i < _queues.size(); ++i) {
+    Queue& queue = *_queues[(worker + i) % _queues.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.indices.empty()) {
+      idx = queue.indices.back();
+      queue.indices.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace model_scanner
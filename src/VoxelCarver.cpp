@@ -0,0 +1,187 @@
+#include <model_scanner/VoxelCarver.h>
+#include <cmath>
+
+namespace model_scanner {
+
+VoxelCarver::VoxelCarver(Octree& octree, size_t numThreads)
+  : _octree(octree), _pool(numThreads) {}
+
+void VoxelCarver::carve(const cv::Mat& frame, const glm::mat4& proj,
+                        const glm::mat4& modelView) {
+  _deferredHits.resize(_octree._header.size, 0);
+  _deferredTotal.resize(_octree._header.size, 0);
+  _mask.build(frame);
+
+  // Clip coordinates are linear in the world position, so the corners of
+  // every node follow from the root's corner and edges
+  glm::mat4 mvp = proj * modelView;
+  Octree::Box root = _octree.rootBox();
+  glm::vec3 size = root.maxPoint - root.minPoint;
+  Projection projection;
+  projection.origin = mvp * glm::vec4(root.minPoint, 1.0f);
+  projection.axes[0] = mvp * glm::vec4(size.x, 0.0f, 0.0f, 0.0f);
+  projection.axes[1] = mvp * glm::vec4(0.0f, size.y, 0.0f, 0.0f);
+  projection.axes[2] = mvp * glm::vec4(0.0f, 0.0f, size.z, 0.0f);
+  projection.width = frame.cols;
+  projection.height = frame.rows;
+
+  std::vector<Entry> stack = { { 0, 0, glm::uvec3(0, 0, 0) } };
+  std::vector<Entry> split;
+  traverse(stack, projection, &split);
+
+  _pool.parallelFor(split.size(), [&](size_t idx, size_t) {
+    std::vector<Entry> subtree;
+    pushChildren(split[idx],
+                 _octree.firstChild(split[idx].idx, split[idx].depth),
+                 subtree);
+    traverse(subtree, projection, nullptr);
+  });
+}
+
+void VoxelCarver::flush() {
+  _deferredHits.resize(_octree._header.size, 0);
+  _deferredTotal.resize(_octree._header.size, 0);
+
+  std::vector<Entry> level = { { 0, 0, glm::uvec3(0, 0, 0) } };
+  for (int depth = 0; depth < SPLIT_DEPTH; ++depth) {
+    std::vector<Entry> next;
+    for (const Entry& entry : level) {
+      size_t children = _octree.firstChild(entry.idx, entry.depth);
+      if (children == 0)
+        continue;
+      pushDown(entry.idx, children, entry.depth);
+      pushChildren(entry, children, next);
+    }
+    level.swap(next);
+  }
+
+  _pool.parallelFor(level.size(), [&](size_t idx, size_t) {
+    flushNode(level[idx].idx, level[idx].depth);
+  });
+}
+
+uint32_t VoxelCarver::refineMinSamples() const {
+  return REFINE_MIN_FRAMES;
+}
+
+// Nodes that are behind the camera or outside the frame tell nothing and
+// are skipped, like pixels that are not rendered. Nodes only partially in
+// the frame are treated as straddling the silhouette.
+void VoxelCarver::traverse(std::vector<Entry>& stack, const Projection& proj,
+                           std::vector<Entry>* split) {
+  while (!stack.empty()) {
+    Entry entry = stack.back();
+    stack.pop_back();
+    if (_octree.isFrozen(entry.idx))
+      continue;
+
+    cv::Rect rect;
+    bool clipped;
+    if (!footprint(entry, proj, rect, clipped))
+      continue;
+
+    size_t children = _octree.firstChild(entry.idx, entry.depth);
+    MaskPyramid::Coverage coverage =
+        clipped ? MaskPyramid::MIXED : _mask.coverage(rect);
+    if (coverage != MaskPyramid::MIXED) {
+      defer(entry.idx, children, coverage == MaskPyramid::INSIDE, 1);
+      continue;
+    }
+
+    // A straddling node is not entirely inside the silhouette, so it only
+    // counts as seen. Leaves are a hit when most of their footprint is.
+    ++_octree._total[entry.idx];
+    if (children == 0) {
+      if (2 * _mask.count(rect) >= (uint32_t) rect.area())
+        ++_octree._hits[entry.idx];
+      continue;
+    }
+
+    pushDown(entry.idx, children, entry.depth);
+    if (split && entry.depth >= SPLIT_DEPTH)
+      split->push_back(entry);
+    else
+      pushChildren(entry, children, stack);
+  }
+}
+
+bool VoxelCarver::footprint(const Entry& entry, const Projection& proj,
+                            cv::Rect& rect, bool& clipped) const {
+  float scale = 1.0f / (1u << entry.depth);
+  float minX = INFINITY;
+  float minY = INFINITY;
+  float maxX = -INFINITY;
+  float maxY = -INFINITY;
+  for (unsigned corner = 0; corner < 8; ++corner) {
+    glm::vec4 clip =
+        proj.origin +
+        (proj.axes[0] * float(entry.pos.x + (corner & 1)) +
+         proj.axes[1] * float(entry.pos.y + ((corner >> 1) & 1)) +
+         proj.axes[2] * float(entry.pos.z + ((corner >> 2) & 1))) *
+            scale;
+    if (clip.w <= 0.0f)
+      return false;
+    float x = (clip.x / clip.w * 0.5f + 0.5f) * proj.width;
+    float y = (clip.y / clip.w * 0.5f + 0.5f) * proj.height;
+    minX = std::min(minX, x);
+    minY = std::min(minY, y);
+    maxX = std::max(maxX, x);
+    maxY = std::max(maxY, y);
+  }
+
+  // Clamp before converting so that nodes close to the camera don't
+  // overflow
+  int x0 = std::floor(std::clamp(minX, -1.0f, proj.width + 1.0f));
+  int y0 = std::floor(std::clamp(minY, -1.0f, proj.height + 1.0f));
+  int x1 = std::ceil(std::clamp(maxX, -1.0f, proj.width + 1.0f));
+  int y1 = std::ceil(std::clamp(maxY, -1.0f, proj.height + 1.0f));
+  cv::Rect full(x0, y0, std::max(x1 - x0, 1), std::max(y1 - y0, 1));
+  rect = full & cv::Rect(0, 0, proj.width, proj.height);
+  clipped = rect.area() != full.area();
+  return !rect.empty();
+}
+
+void VoxelCarver::defer(size_t idx, size_t children, uint32_t hits,
+                        uint32_t total) {
+  if (_octree.isFrozen(idx))
+    return;
+  _octree._hits[idx] += hits;
+  _octree._total[idx] += total;
+  if (children == 0)
+    return;
+  _deferredHits[idx] += hits;
+  _deferredTotal[idx] += total;
+}
+
+void VoxelCarver::pushDown(size_t idx, size_t children, int depth) {
+  uint32_t hits = _deferredHits[idx];
+  uint32_t total = _deferredTotal[idx];
+  if (total == 0)
+    return;
+  _deferredHits[idx] = 0;
+  _deferredTotal[idx] = 0;
+  for (size_t octant = 0; octant < 8; ++octant)
+    defer(children + octant, _octree.firstChild(children + octant, depth + 1),
+          hits, total);
+}
+
+void VoxelCarver::flushNode(size_t idx, int depth) {
+  size_t children = _octree.firstChild(idx, depth);
+  if (children == 0)
+    return;
+  pushDown(idx, children, depth);
+  for (size_t octant = 0; octant < 8; ++octant)
+    flushNode(children + octant, depth + 1);
+}
+
+void VoxelCarver::pushChildren(const Entry& entry, size_t children,
+                               std::vector<Entry>& stack) const {
+  for (unsigned octant = 0; octant < 8; ++octant) {
+    glm::uvec3 pos(2 * entry.pos.x + (octant & 1),
+                   2 * entry.pos.y + ((octant >> 1) & 1),
+                   2 * entry.pos.z + ((octant >> 2) & 1));
+    stack.push_back({ (uint32_t) (children + octant), entry.depth + 1, pos });
+  }
+}
+
+}  // namespace model_scanner
@@ -4,48 +4,207 @@
 #include <GL/glew.h>
 #include <GL/glut.h>
 #include <model_scanner/Window.h>
+#include <model_scanner/Headless.h>
+#include <model_scanner/ShardCoordinator.h>
 
 int main(int argc, char** argv) {
-  glutInit(&argc, argv);
-
-  std::string source = "/dev/video0";
-  std::string outputFile = "model.stl";
-  std::string cameraInfo = "";
-  uint octreeDepth = 4;
+  model_scanner::Scanner::Options options;
+  bool batch = false;
+  // Every further -s and -c adds a camera
+  bool hasSource = false;
+  bool hasCalibration = false;
+  size_t numShards = 1;
+  // Workers are started with the same arguments
+  std::vector<std::string> args(argv, argv + argc);
 
   static struct option longopts[] = {
     { "octree-depth", required_argument, nullptr, 'd' },
     { "output", required_argument, nullptr, 'o' },
     { "camera-info", required_argument, nullptr, 'c' },
     { "source", required_argument, nullptr, 's' },
+    { "batch", no_argument, nullptr, 'b' },
+    { "sparse", no_argument, nullptr, 'S' },
+    { "cpu", no_argument, nullptr, 'C' },
+    { "threads", required_argument, nullptr, 'j' },
+    { "voxel", no_argument, nullptr, 'V' },
+    { "async", no_argument, nullptr, 'a' },
+    { "frame-policy", required_argument, nullptr, 'p' },
+    { "gpu-undistort", no_argument, nullptr, 'g' },
+    { "track", no_argument, nullptr, 't' },
+    { "stream-uploads", no_argument, nullptr, 'u' },
+    { "autosave", required_argument, nullptr, 'A' },
+    { "merge-faces", no_argument, nullptr, 'm' },
+    { "smooth", no_argument, nullptr, 'M' },
+    { "checkpoint", required_argument, nullptr, 'k' },
+    { "freeze", no_argument, nullptr, 'F' },
+    { "trace", required_argument, nullptr, 'T' },
+    { "preview-interval", required_argument, nullptr, 'P' },
+    { "preview-scale", required_argument, nullptr, 'R' },
+    { "no-preview", no_argument, nullptr, 'N' },
+    { "shards", required_argument, nullptr, 'W' },
+    { "shard", required_argument, nullptr, 'w' },
+    { "keyframe-angle", required_argument, nullptr, 'K' },
+    { "keyframe-distance", required_argument, nullptr, 'D' },
+    { "keyframe-gain", required_argument, nullptr, 'Q' },
+    { "luma", no_argument, nullptr, 'L' },
     { 0, 0, 0, 0 }
   };
 
   int longind = 0;
   int opt;
-  while ((opt = getopt_long(argc, argv, "d:o:c:s:", longopts, &longind)) !=
-         -1) {
+  while ((opt = getopt_long(argc, argv,
+                            "d:o:c:s:bSCj:Vap:gtuA:mMk:FT:P:R:NW:w:K:D:Q:L",
+                            longopts, &longind)) != -1) {
     switch (opt) {
       case 'd': {
         std::stringstream ss(optarg);
-        ss >> octreeDepth;
+        ss >> options.octreeDepth;
         break;
       }
       case 'o':
-        outputFile = optarg;
+        options.outFileName = optarg;
         break;
       case 'c':
-        cameraInfo = optarg;
+        if (hasCalibration)
+          options.extraCalibrationFiles.push_back(optarg);
+        else
+          options.calibrationFile = optarg;
+        hasCalibration = true;
         break;
       case 's':
-        source = optarg;
+        if (hasSource)
+          options.extraDeviceNames.push_back(optarg);
+        else
+          options.deviceName = optarg;
+        hasSource = true;
+        break;
+      case 'b':
+        batch = true;
+        break;
+      case 'S':
+        options.sparseOctree = true;
+        break;
+      case 'C':
+        options.cpuCarving = true;
+        break;
+      case 'V':
+        options.voxelCarving = true;
+        break;
+      case 'a':
+        options.asyncCapture = true;
+        break;
+      case 'g':
+        options.gpuUndistort = true;
+        break;
+      case 't':
+        options.tagTracking = true;
+        break;
+      case 'u':
+        options.streamUploads = true;
+        break;
+      case 'm':
+        options.mergeFaces = true;
+        break;
+      case 'M':
+        options.smoothSurface = true;
+        break;
+      case 'k':
+        options.checkpointFile = optarg;
+        break;
+      case 'F':
+        options.freezeNodes = true;
+        break;
+      case 'T':
+#ifdef MODEL_SCANNER_PROFILE
+        options.traceFile = optarg;
+#else
+        std::cerr << "Warning: Built without MODEL_SCANNER_PROFILE, no trace "
+                  << "is recorded" << std::endl;
+#endif
+        break;
+      case 'N':
+        options.preview = false;
+        break;
+      case 'L':
+        options.lumaCapture = true;
+        break;
+      case 'p':
+        if (std::string(optarg) == "block") {
+          options.framePolicy = model_scanner::FramePipeline::BLOCK;
+        } else if (std::string(optarg) == "drop") {
+          options.framePolicy = model_scanner::FramePipeline::DROP_OLDEST;
+        } else {
+          std::cerr << "Error: Unknown frame policy " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 'j': {
+        std::stringstream ss(optarg);
+        ss >> options.numThreads;
+        break;
+      }
+      case 'A': {
+        std::stringstream ss(optarg);
+        ss >> options.autosaveInterval;
+        break;
+      }
+      case 'P': {
+        std::stringstream ss(optarg);
+        ss >> options.previewInterval;
+        break;
+      }
+      case 'R': {
+        std::stringstream ss(optarg);
+        ss >> options.previewScale;
+        break;
+      }
+      case 'W': {
+        std::stringstream ss(optarg);
+        ss >> numShards;
+        break;
+      }
+      case 'K': {
+        std::stringstream ss(optarg);
+        ss >> options.keyframeAngle;
+        break;
+      }
+      case 'D': {
+        std::stringstream ss(optarg);
+        ss >> options.keyframeDistance;
         break;
+      }
+      case 'Q': {
+        std::stringstream ss(optarg);
+        ss >> options.keyframeGain;
+        break;
+      }
+      case 'w': {
+        std::stringstream ss(optarg);
+        char slash;
+        ss >> options.shard >> slash >> options.numShards;
+        if (!ss || slash != '/' || options.shard >= options.numShards) {
+          std::cerr << "Error: Invalid shard " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      }
       default:
         break;
     }
   }
 
-  model_scanner::Window window(source, cameraInfo, outputFile, octreeDepth);
+  if (numShards > 1 && options.numShards == 1) {
+    model_scanner::ShardCoordinator coordinator(options, numShards, args);
+    return coordinator.run();
+  }
+
+  if (batch) {
+    model_scanner::Headless headless(options);
+    return headless.run();
+  }
+
+  glutInit(&argc, argv);
+  model_scanner::Window window(options);
   glutMainLoop();
   return 0;
 }
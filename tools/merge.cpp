@@ -0,0 +1,58 @@
+#include <iostream>
+#include <getopt.h>
+#include <model_scanner/Octree.h>
+
+// Sums the counters of octree checkpoints of the same volume, written by
+// separate scans, into one checkpoint and optionally a model
+int main(int argc, char** argv) {
+  std::string outFileName;
+  std::string modelFileName;
+  float threshold = 0.9;
+
+  static struct option longopts[] = {
+    { "output", required_argument, nullptr, 'o' },
+    { "model", required_argument, nullptr, 'm' },
+    { "threshold", required_argument, nullptr, 't' },
+    { 0, 0, 0, 0 }
+  };
+
+  int longind = 0;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "o:m:t:", longopts, &longind)) !=
+         -1) {
+    switch (opt) {
+      case 'o':
+        outFileName = optarg;
+        break;
+      case 'm':
+        modelFileName = optarg;
+        break;
+      case 't':
+        threshold = std::stof(optarg);
+        break;
+      default:
+        break;
+    }
+  }
+
+  if (optind >= argc || (outFileName.empty() && modelFileName.empty())) {
+    std::cerr << "Usage: " << argv[0] << " [-o merged.oct] [-m model.stl] "
+              << "[-t threshold] scan.oct..." << std::endl;
+    return 1;
+  }
+
+  model_scanner::Octree merged;
+  if (!merged.load(argv[optind]))
+    return 1;
+  for (int i = optind + 1; i < argc; ++i) {
+    model_scanner::Octree octree;
+    if (!octree.load(argv[i]) || !merged.merge(octree))
+      return 1;
+  }
+
+  if (!outFileName.empty() && !merged.save(outFileName))
+    return 1;
+  if (!modelFileName.empty())
+    merged.write(modelFileName, threshold);
+  return 0;
+}